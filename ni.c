@@ -1,47 +1,76 @@
 // -------------------------------- Includes ----------------------------------
-#include <ctype.h>   // isnumber, isblank, isprint, isspace, isalnum
-#include <errno.h>   // errno
+#include <ctype.h>   // isdigit, isblank, isprint, isspace, isalnum
+#include <errno.h>   // errno, EINTR
+#include <fcntl.h>   // open, fcntl, O_RDONLY, O_WRONLY, O_TRUNC, O_NONBLOCK
+#include <limits.h>  // UINT_MAX
+#include <poll.h>    // poll, struct pollfd, POLLIN
+#include <pthread.h> // pthread_create, pthread_mutex_lock, pthread_cond_wait
 #include <signal.h>  // signal, SIGWINCH
+#include <stdatomic.h> // atomic_size_t, atomic_bool, atomic_load, atomic_store
 #include <stdarg.h>  // va_list, va_start, va_end
 #include <stdbool.h> // bool, true, false
-#include <stdio.h>   // fopen, fclose, perror, sys_nerr
-#include <stdlib.h>  // realloc, free, exit, atexit
-#include <string.h>  // strndup, strdup, memmove
+#include <stdio.h>   // fopen, fclose, perror, rename
+#include <stdlib.h>  // realloc, free, exit, atexit, mkstemp, realpath
+#include <string.h>  // strndup, strdup, strerror, memmove, memchr, memmem
+#include <sys/ioctl.h> // ioctl, struct winsize, TIOCGWINSZ
+#include <sys/mman.h> // mmap, munmap, PROT_READ, MAP_PRIVATE, MAP_FIXED, MAP_FAILED
+#include <sys/stat.h> // fstat, fchmod, umask, struct stat
+#include <sys/uio.h> // writev, struct iovec
 #include <termios.h> // struct termios, tcsetattr, tcgetattr, TCSANOW, BRKINT, ICRNL, INPCK, ISTRIP, IXON, OPOST, CS8, ECHO, ICANON, ISIG, IEXTEN
 #include <time.h>    // timespec_get, struct timespec, TIME_UTC
-#include <unistd.h>  // write, read, STDIN_FILENO, STDOUT_FILENO
+#include <unistd.h>  // write, read, close, pipe, unlink, fsync, sysconf, STDIN_FILENO, STDOUT_FILENO
+#ifdef __x86_64__
+#include <immintrin.h> // _mm_cmpeq_epi8, _mm256_cmpeq_epi8, _mm_movemask_epi8
+#endif
 
 // --------------------------------- Defines ----------------------------------
 #define NI_VERSION "0.0.1"
 
 #define NORETURN __attribute__((noreturn)) void
 
-#define MAX_SCREEN_LEN 1 << 16
-#define MAX_RENDER 1024
+#define MIN_SCREEN_CAP (1 << 16)
+#define MAX_WRITE (1 << 16)
+#define MAX_ROWS 512
 #define MAX_MESSAGE_LEN 256
+#define MAX_INPUT_LEN 4096
+#define HIST_BUCKETS 512
 #define MAX_CHORD 3 // d[ge] or d[f..]
+#define MAX_COUNT 999999999
+#define MAX_QUERY 128
+#define MAX_INSTS (2 * MAX_QUERY + 2) // at most two per byte of the query
+#define MAX_DFA_STATES 256 // cached per automaton, flushed when full
+#define SEARCH_RUN (1 << 20) // max bytes of lines searched in one go
+#define MATCH_RANGE (1 << 16) // lines scanned for matches by one worker
+#define MIN_LINE_CAP 16
+#define SHARED (1u << 31) // see Line.cap
+#define CHUNK_SIZE (16 << 20) // bytes of a file indexed by one worker
+#define SAVE_BATCH 512 // lines per writev, two segments each
+#define SAVE_PROGRESS (64 << 20) // bytes between save progress updates
 #define TABSTOP 8
+#define RX_STEP 4096 // columns between the rx checkpoints of a line
+#define RX_SLOTS MAX_ROWS // lines with rx checkpoints, one per screen row
+#define ESCAPE_TIMEOUT_MS 25
 #define NUM_UTIL_LINES 2
 
 // Mask 00011111 i.e. zero out the upper three bits
 #define CTRL_KEY(k) ((k)&0x1f)
 
 // Input / output
-#define READ(C) (read(STDIN_FILENO, &(C), 1) == 1)
+#define READ(C) input_read(&(C), -1)
+#define READ_ESCAPE(C) input_read(&(C), ESCAPE_TIMEOUT_MS)
 #define SEND_ESCAPE(C)                                                         \
 	(write(STDOUT_FILENO, (C), sizeof(C) - 1) == sizeof(C) - 1)
 
 // Error handling / Debugging
 #define STR(A) #A
 
-#define PERROR_(F, L, S)                                                       \
-	do {                                                                   \
-		if (errno >= 0 && errno < sys_nerr)                            \
-			perror(F ":" STR(L) " " S);                            \
-		else printf("%s:%d %s\n", F, L, S);                            \
-	} while (0)
+#define PERROR_(F, L, S) perror(F ":" STR(L) " " S)
 #define PERROR(S) PERROR_(__FILE__, __LINE__, S)
 
+// Times statement S as phase NAME of the frame profiler
+#define PROFILE(NAME, S)                                                       \
+	do { unsigned long t_ = get_current_time(); S; trace(NAME, t_); } while (0)
+
 #define DIE(S)                                                                 \
 	do {                                                                   \
 		clear_screen();                                                \
@@ -50,11 +79,13 @@
 	} while (0)
 
 // Common constructs
-#define CLINE (E.lines + E.cy)
+#define CLINE line_at(E.cy)
 #define NOLINES (E.numlines == 0)
 #define LASTLINE (E.numlines - 1)
+#define SCANNING (E.matches.stitched < E.matches.numranges)
 #define ENDOFLINE (CLINE->len - 1)
-#define MIN(A, B) (A) <= (B) ? (A) : (B)
+#define MIN(A, B) ((A) <= (B) ? (A) : (B))
+#define MAX(A, B) ((A) >= (B) ? (A) : (B))
 
 // ---------------------------------- Types -----------------------------------
 typedef unsigned int uint;
@@ -63,6 +94,7 @@ typedef struct termios Term;
 typedef enum EditorMode {
 	MODE_NORMAL,
 	MODE_INSERT,
+	MODE_SEARCH,
 } EditorMode;
 
 typedef enum EditorKey {
@@ -75,12 +107,14 @@ typedef enum EditorKey {
 	KEY_DELETE,
 	KEY_RETURN,
 	KEY_ESCAPE,
+	KEY_PASTE,
 	KEY_NOOP,
 } EditorKey;
 
 typedef struct ScreenBuffer {
-	char data[MAX_SCREEN_LEN];
-	size_t len;
+	char *data;
+	size_t len, cap;
+	uint writes, copies; // for the stats
 } ScreenBuffer;
 
 typedef struct MessageBuffer {
@@ -88,29 +122,233 @@ typedef struct MessageBuffer {
 	size_t len;
 } MessageBuffer;
 
+typedef struct InputBuffer {
+	char data[MAX_INPUT_LEN];
+	size_t len, pos;
+	bool eof;
+} InputBuffer;
+
 typedef struct Line {
 	uint len;
+	// Allocated size of `chars`. Lines loaded from a file have a capacity of
+	// zero and point straight into the mapped file until they are edited.
+	// The SHARED bit is set when a snapshot (see take_snapshot) may read
+	// `chars`, and only counts while there is one.
+	uint cap;
 	char *chars;
 } Line;
 
+// The lines that start in [start, end) of the mapped file, indexed by a
+// worker and appended to the line table once every chunk before it is in.
+typedef struct Chunk {
+	char *start, *end;
+	Line *lines;
+	uint numlines, cap;
+	bool done;
+} Chunk;
+
+// A background save. The snapshot is a copy of the line table taken when
+// the save started; its buffers are shared with the editor until it is done.
+typedef struct Save {
+	pthread_t thread;
+	Line *lines;
+	uint numlines;
+	unsigned long generation, started;
+	atomic_size_t written;
+	size_t shown; // MB written as of the last progress message
+	atomic_bool done;
+	bool running, again; // `again` if a save was asked for while running
+	int error; // errno of the failed call, 0 on success
+	char path[PATH_MAX]; // the file with symlinks resolved
+	mode_t umask; // read once at startup, as reading it means setting it
+	bool copied; // the open file's mapping has been moved to a copy
+} Save;
+
+typedef enum EditKind {
+	EDIT_TEXT,  // characters at (y, x)
+	EDIT_LINES, // whole lines from y on
+	EDIT_BREAK, // a line break after column x of line y (split / join)
+} EditKind;
+
+// One primitive edit in the undo log. An edit knows whether it inserted or
+// removed its text, lines or line break, so it is undone by doing the
+// opposite. Text edits keep a copy of their characters. Line edits keep the
+// lines that are not in the buffer right now: the deleted ones, or the
+// inserted ones after they were undone. Lines move between the buffer and
+// the log, their text is never copied.
+typedef struct Edit {
+	EditKind kind;
+	bool inserted;
+	uint group; // edits of one command or insert session share a group
+	uint y, x, n; // position and number of characters or lines
+	char *text;
+	Line *lines;
+} Edit;
+
+typedef struct UndoLog {
+	Edit *edits;
+	uint len, cap;
+	uint pos;   // edits from `pos` on have been undone and can be redone
+	uint group; // bumped for every command in normal mode
+} UndoLog;
+
 typedef struct Find {
 	char c;
 	bool forward;
 } Find;
 
+typedef enum InstOp {
+	OP_CLASS, // one byte of `set`, then on to out[0]
+	OP_SPLIT, // on to out[0] and out[1] (if any) without a byte
+	OP_MATCH,
+} InstOp;
+
+// An instruction of a Thompson NFA. While a program is compiled, the outs
+// that don't point anywhere yet are chained through each other (see SLOT).
+typedef struct Inst {
+	InstOp op;
+	int out[2];
+	unsigned char set[32];
+} Inst;
+
+typedef struct Program {
+	Inst insts[MAX_INSTS];
+	uint len;
+	int start, match;
+} Program;
+
+// A compiled search pattern. The reverse program matches the pattern read
+// backwards: run from the end of a line, it accepts at every column where a
+// match starts. `lit` is a string every match contains, found with memmem
+// before a line is handed to the automaton. A `plain` pattern has no special
+// characters and is searched for with memmem alone.
+typedef struct Regex {
+	Program fwd, rev;
+	bool ok, plain, bol, eol; // bol / eol: anchored by '^' / '$'
+	bool backtrack; // NI_REGEX=backtrack, the baseline for `make bench`
+	char lit[MAX_QUERY];
+	uint litlen;
+} Regex;
+
+typedef struct Frag {
+	int start, outs; // outs: the chain of dangling outs
+} Frag;
+
+typedef struct Parser {
+	const char *s, *end;
+	Regex *re;
+	Program *g;
+	bool reverse, special, alt, error;
+	int depth, atom; // atom: the byte of a plain one-byte atom, or -1
+	char run[MAX_QUERY]; // the plain bytes in a row at the top level
+	uint runlen;
+} Parser;
+
+// A state of the lazy DFA: a set of NFA instructions. Transitions are
+// worked out the first time they are taken.
+typedef struct DfaState {
+	unsigned char set[(MAX_INSTS + 7) / 8];
+	bool match, dead;
+	int next[256]; // next state + 1, 0 if not known yet
+} DfaState;
+
+// With `restart`, the automaton starts over at every byte, i.e. the match
+// may begin anywhere.
+typedef struct Dfa {
+	const Program *prog;
+	bool restart;
+	DfaState *states;
+	uint len;
+	int start;
+} Dfa;
+
+// The `/` or `?` search. While the query is typed, the cursor jumps to the
+// first match from where the search started.
+typedef struct Search {
+	char query[MAX_QUERY];
+	uint len;
+	bool forward;
+	uint y, x; // where the search started
+	Regex re;
+	Dfa fwd, rev;
+} Search;
+
+typedef struct Match {
+	uint y, x;
+} Match;
+
+typedef struct MatchList {
+	Match *data;
+	uint len, cap;
+} MatchList;
+
+// The lines [start, end) of the search snapshot, scanned for matches by a
+// worker. The lines of its matches count from the start of the snapshot.
+typedef struct Range {
+	uint start, end;
+	MatchList found;
+	bool done;
+} Range;
+
+// Every match of the last search, in buffer order, for n / N and the match
+// count. Lines before `upto` are indexed, the rest is scanned by a pool of
+// workers in ranges of a snapshot of the lines; the ranges are appended to
+// the index in order.
+// Edits of indexed lines update the index in place. Like the line table it
+// is a gap buffer, and the matches after the gap hold their line minus
+// `shift`, the number of lines inserted (less the deleted ones) in front of
+// them. Inserting or deleting lines only moves the gap to the edit and
+// changes `shift`. Snapshot line 0 is line `base + shift`. Edits past
+// `upto` are queued while the workers go on (see queue_lines). Text edits
+// only mark their line as `pending`, so that a run of keys on one line
+// rescans it once.
+typedef struct MatchIndex {
+	bool active;
+	Match *matches;
+	uint len, cap, gap, upto, pending; // pending line + 1, 0 if none
+	int shift;
+	bool queued; // edits past `upto`, see queue_lines
+	uint qfrom, qto;
+	int qshift;
+	uint skip; // the snapshot lines before it are in the index
+	MatchList found; // scratch space for the matches of rescanned lines
+	Line *lines;
+	uint base;
+	Range *ranges;
+	uint numranges, stitched, next;
+	pthread_t *threads;
+	uint numthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	atomic_bool cancel;
+} MatchIndex;
+
+// The render column of every RX_STEP-th column of line `y`, the first
+// `len` of them, so that long lines are walked from the nearest checkpoint
+// instead of from the start.
+typedef struct RxIndex {
+	uint y;
+	uint *rx;
+	uint len, cap;
+} RxIndex;
+
 typedef struct Chord {
 	char keys[MAX_CHORD];
 	uint len;
+	uint count; // the count typed before the keys, 0 if none
+	uint motion; // the count typed after an operator (d2w), 0 if none
 } Chord;
 
 typedef struct Editor {
 	// Terminal
 	Term term_orig;
-	Term term;
 
 	// Lines
+	// Kept as a gap buffer: the `linecap - numlines` unused slots sit right
+	// after line `gap`, so inserting or deleting lines around the cursor
+	// only moves the lines between the previous edit and this one.
 	Line *lines;
-	uint numlines;
+	uint numlines, linecap, gap;
 
 	// Cursor
 	uint cx, cy, rx;
@@ -118,17 +356,47 @@ typedef struct Editor {
 	// Viewport
 	uint rowoff, coloff;
 	uint rows, cols;
+	// SIGWINCH ('w'), the index workers ('i'), the save ('s') and the search
+	// workers ('m') write a byte to wake_pipe, which is polled next to stdin
+	int wake_pipe[2];
+	bool resized;
 
 	// Mode
 	EditorMode mode;
 
 	// File
 	char *filename;
+	char *map;
+	size_t maplen;
 	bool dirty;
+	// Bumped by every edit, so that a save knows whether it caught them all
+	unsigned long generation;
+	// Number of snapshots taken and not yet dropped, and the buffers the
+	// editor let go of while they were shared with one
+	uint snapshots;
+	char **retired;
+	uint numretired, retiredcap;
+	Save save;
+	UndoLog undo;
+	// Large files are indexed in chunks on a pool of workers. Chunks before
+	// `stitched` are in the line table, `next_chunk` is the next one to be
+	// picked up by a worker. `index_lock` guards the chunks.
+	Chunk *chunks;
+	uint numchunks, stitched, next_chunk;
+	pthread_mutex_t index_lock;
+	pthread_cond_t index_cond;
+	unsigned long index_started;
 
 	// Input
+	// Everything the terminal had ready at the last read. All of it is
+	// processed before the next frame is drawn.
+	InputBuffer input;
 	Chord chord;
 	Find find;
+	Search search;
+	MatchIndex matches;
+	MatchList starts; // of the matches on the row being drawn
+	uint next_start;
 
 	// Status & Messages
 	MessageBuffer message;
@@ -137,10 +405,29 @@ typedef struct Editor {
 	// Screen i.e draw buffer. The output is written to this buffer so that
 	// it can be send to the screen in a single call to avoid flickering.
 	ScreenBuffer screen;
-	// Renders individual lines before printing them to the screen.
-	// TODO: Do we even need this buffer? Why not render straight to the
-	// screen?
-	char render_buffer[MAX_RENDER];
+	// Hash of every row as it was last sent to the terminal. Rows that
+	// come out the same are dropped from the frame.
+	unsigned long rowhash[MAX_ROWS];
+	uint damage, drawn_rowoff, drawn_coloff; // see modified
+	RxIndex rx_index[RX_SLOTS]; // see cx2rx
+	// Stats for the last frame: bytes written, keys in the batch and the
+	// time from the first key of the batch until the frame was written.
+	size_t written;
+	uint frame_writes, frame_copies;
+	uint keys, batch;
+	unsigned long received, latency;
+	// Log-linear histogram of all frame latencies (see bucket_of)
+	unsigned long histogram[HIST_BUCKETS], latency_max;
+	// Profiled phases are streamed to $NI_TRACE while profiling is on
+	bool profiling;
+	FILE *trace;
+	uint traced;
+
+	// Replay
+	// Headless mode: keys are read from stdin without a terminal and the
+	// totals are reported on exit.
+	bool replay;
+	unsigned long started, frames, total_keys, total_bytes;
 
 	// Settings
 	char render_tab_characters[2];
@@ -161,66 +448,107 @@ static NORETURN quit(int code) {
 }
 
 static void reset_term(void) {
+	SEND_ESCAPE("\x1b[?2004l"); // disable bracketed paste
 	if (tcsetattr(STDIN_FILENO, TCSANOW, &E.term_orig) == -1)
 		DIE("tcsetattr");
 }
 
-static void enable_immediate_mode(void) {
-	E.term.c_cc[VMIN] = 0;
-	E.term.c_cc[VTIME] = 0;
-
-	if (tcsetattr(STDIN_FILENO, TCSANOW, &E.term) == -1) DIE("tcsetattr");
-}
-
-static void enable_block_mode(void) {
-	E.term.c_cc[VMIN] = 1;
-	E.term.c_cc[VTIME] = 0;
-
-	if (tcsetattr(STDIN_FILENO, TCSANOW, &E.term) == -1) DIE("tcsetattr");
-}
-
 static void enable_raw_mode(void) {
 	// Save terminal settings and setup cleanup on exit.
 	if (tcgetattr(STDIN_FILENO, &E.term_orig) == -1) DIE("tcgetattr");
 	atexit(reset_term);
 
 	// Set terminal to raw mode.
-	E.term = E.term_orig;
-	E.term.c_iflag &= ~(uint)(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-	E.term.c_oflag &= ~(uint)(OPOST);
-	E.term.c_cflag |= (uint)(CS8);
-	E.term.c_lflag &= ~(uint)(ECHO | ICANON | ISIG | IEXTEN);
-	E.term.c_cc[VMIN] = 1;
-	E.term.c_cc[VTIME] = 0;
+	Term term = E.term_orig;
+	term.c_iflag &= ~(uint)(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	term.c_oflag &= ~(uint)(OPOST);
+	term.c_cflag |= (uint)(CS8);
+	term.c_lflag &= ~(uint)(ECHO | ICANON | ISIG | IEXTEN);
+	term.c_cc[VMIN] = 1;
+	term.c_cc[VTIME] = 0;
+
+	if (tcsetattr(STDIN_FILENO, TCSANOW, &term) == -1) DIE("tcsetattr");
+	SEND_ESCAPE("\x1b[?2004h"); // enable bracketed paste
+}
+
+// Waits at most `timeout` milliseconds (forever if negative) for the
+// terminal and fills the empty input buffer. A resize or an indexed chunk
+// ends the wait early. All pending wake-up bytes are drained at once (into
+// the empty input buffer), so a burst of them is handled by one frame.
+// Returns whether there is input.
+static bool input_wait(int timeout) {
+	InputBuffer *in = &E.input;
+	struct pollfd pfd[2] = {{.fd = STDIN_FILENO, .events = POLLIN},
+	                        {.fd = E.wake_pipe[0], .events = POLLIN}};
+	int ready = poll(pfd, 2, timeout);
+	if (ready < 0 && errno != EINTR) in->eof = true;
+	if (ready <= 0) return false;
+	if (pfd[1].revents & POLLIN) {
+		ssize_t n = read(E.wake_pipe[0], in->data, MAX_INPUT_LEN);
+		E.resized |= n > 0 && memchr(in->data, 'w', (size_t)n);
+		return false;
+	}
+
+	ssize_t n = read(STDIN_FILENO, in->data, sizeof in->data);
+	in->pos = 0;
+	in->len = n > 0 ? (size_t)n : 0;
+	in->eof = n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN);
+	return n > 0;
+}
 
-	if (tcsetattr(STDIN_FILENO, TCSANOW, &E.term) == -1) DIE("tcsetattr");
+static unsigned long get_current_time(void);
+
+// Reads the next input byte, waiting for it like input_wait when the buffer
+// is empty. The wait goes on through wake-ups and interrupted calls for the
+// whole timeout, so that neither a paste nor a split escape sequence is cut
+// short. Without a timeout false means that the input has ended.
+static bool input_read(char *c, int timeout) {
+	InputBuffer *in = &E.input;
+	const unsigned long deadline =
+		get_current_time() + (unsigned long)MAX(timeout, 0) * 1000;
+	while (in->pos == in->len && !input_wait(timeout)) {
+		if (in->eof) return false;
+		if (timeout < 0) continue;
+		unsigned long now = get_current_time();
+		if (now >= deadline) return false;
+		timeout = (int)((deadline - now + 999) / 1000);
+	}
+
+	*c = in->data[in->pos++];
+	return true;
 }
 
 static int read_escape_sequence(void) {
-	enable_immediate_mode();
-	EditorKey key = KEY_ESCAPE;
-	char seq[3];
+	char seq[5];
 
-	if (!READ(seq[0])) goto outro;
-	if (!READ(seq[1])) goto outro;
-	if (seq[0] != '[') goto outro;
+	if (!READ_ESCAPE(seq[0])) return KEY_ESCAPE;
+	if (seq[0] != '[') {
+		// Just an ESC followed by another key; leave that key be.
+		E.input.pos--;
+		return KEY_ESCAPE;
+	}
+	if (!READ_ESCAPE(seq[1])) return KEY_ESCAPE;
 
 	switch (seq[1]) {
-	case 'A': key = KEY_UP; goto outro;
-	case 'B': key = KEY_DOWN; goto outro;
-	case 'D': key = KEY_LEFT; goto outro;
-	case 'C': key = KEY_RIGHT; goto outro;
+	case 'A': return KEY_UP;
+	case 'B': return KEY_DOWN;
+	case 'D': return KEY_LEFT;
+	case 'C': return KEY_RIGHT;
 	}
 
-	if (isnumber(seq[1]) && READ(seq[2]) && seq[2] == '~') switch (seq[1]) {
-		case '3': key = KEY_DELETE; goto outro;
-		case '5': key = KEY_PAGE_UP; goto outro;
-		case '6': key = KEY_PAGE_DOWN; goto outro;
+	if (!isdigit(seq[1]) || !READ_ESCAPE(seq[2])) return KEY_ESCAPE;
+	if (seq[2] == '~') switch (seq[1]) {
+		case '3': return KEY_DELETE;
+		case '5': return KEY_PAGE_UP;
+		case '6': return KEY_PAGE_DOWN;
 		}
 
-outro:
-	enable_block_mode();
-	return (int)key;
+	// Start of a bracketed paste: ESC[200~
+	if (seq[1] == '2' && seq[2] == '0' && READ_ESCAPE(seq[3]) &&
+	    READ_ESCAPE(seq[4]) && seq[3] == '0' && seq[4] == '~')
+		return KEY_PASTE;
+
+	return KEY_ESCAPE;
 }
 
 static int read_key(void) {
@@ -239,180 +567,1441 @@ static int read_key(void) {
 	}
 }
 
-static int get_cursor_position(uint *rows, uint *cols) {
-	// Solicit device report
-	if (!SEND_ESCAPE("\x1b[6n")) return -1;
+static int get_window_size(uint *rows, uint *cols) {
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+		return -1;
 
-	// Read device report: \x1b[<rows>;<cols>R
-	char buf[32];
-	uint i = 0;
-	while (i < sizeof buf - 1) {
-		if (!READ(buf[i])) return -1;
-		if (buf[i++] == 'R') break;
-	}
-	buf[i] = '\0';
+	*rows = ws.ws_row, *cols = ws.ws_col;
+	return 0;
+}
 
-	if (buf[0] != '\x1b' || buf[1] != '[') return -1;
-	if (sscanf(&buf[1], "[%d;%dR", rows, cols) != 2) return -1;
+// ---------------------------------- Misc ------------------------------------
+static unsigned long get_current_time(void) {
+	struct timespec ts;
 
-	return 0;
+	if (timespec_get(&ts, TIME_UTC) == 0) DIE("timespec_get");
+
+	return (unsigned long)ts.tv_sec * 1000000ul +
+	       (unsigned long)ts.tv_nsec / 1000;
 }
 
-static int get_window_size(uint *rows, uint *cols) {
-	// Reset cursor to home
-	if (!SEND_ESCAPE("\x1b[H")) return -1;
+// Latencies below 16 us get a bucket each, above that every power of two is
+// split into 8 buckets, i.e. the bucket width stays within 12.5%.
+static uint bucket_of(unsigned long us) {
+	uint e = us < 16 ? 0 : 60 - (uint)__builtin_clzl(us);
+	return e * 8 + (uint)(us >> e);
+}
 
-	// Move to end
-	if (!SEND_ESCAPE("\x1b[999C\x1b[999B")) return -1;
-	if (get_cursor_position(rows, cols) == -1) return -1;
+static unsigned long bucket_value(uint i) {
+	return i < 16 ? i : (i % 8 + 8ul) << (i / 8 - 1);
+}
 
-	return 0;
+static unsigned long percentile(unsigned long p) {
+	unsigned long n = 0, seen = 0;
+	uint i;
+	for (i = 0; i < HIST_BUCKETS; i++) n += E.histogram[i];
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += E.histogram[i];
+		if (seen * 100 >= n * p) break;
+	}
+	return bucket_value(i);
 }
 
-// ---------------------------------- Misc ------------------------------------
-static struct timespec get_current_time(void) {
-	struct timespec ts;
+// Appends a complete event in Chrome's trace event (JSON array) format. The
+// closing bracket is optional in that format, so the file is valid as is.
+static void trace(const char *name, unsigned long start) {
+	if (!E.profiling || !E.trace) return;
+	fprintf(E.trace,
+	        "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,"
+	        "\"pid\":1,\"tid\":1}",
+	        E.traced++ ? ",\n" : "[\n", name, start,
+	        get_current_time() - start);
+}
 
-	if (timespec_get(&ts, TIME_UTC) == 0) DIE("timespec_get");
+// Writes the histogram as "<us> <count>" lines to $NI_LATENCY_LOG.
+static void dump_histogram(void) {
+	const char *path = getenv("NI_LATENCY_LOG");
+	FILE *f = path ? fopen(path, "w") : NULL;
+	if (!f) return;
+	for (uint i = 0; i < HIST_BUCKETS; i++)
+		if (E.histogram[i])
+			fprintf(f, "%lu %lu\n", bucket_value(i), E.histogram[i]);
+	fclose(f);
+}
 
-	return ts;
+// ---------------------------------- Lines -----------------------------------
+static Line *line_at(uint i) {
+	return E.lines + (i < E.gap ? i : i + E.linecap - E.numlines);
 }
 
-// --------------------------------- Editing ----------------------------------
-static void insert_line(size_t at) {
-	if (at > E.numlines) at = E.numlines;
+static void move_gap(uint at) {
+	const uint gaplen = E.linecap - E.numlines;
+
+	if (at < E.gap)
+		memmove(E.lines + at + gaplen, E.lines + at,
+		        (sizeof *E.lines) * (E.gap - at));
+	else if (at > E.gap)
+		memmove(E.lines + E.gap, E.lines + E.gap + gaplen,
+		        (sizeof *E.lines) * (at - E.gap));
 
-	E.lines = realloc(E.lines, (sizeof *E.lines) * (E.numlines + 1));
+	E.gap = at;
+}
+
+// Makes room for `n` more lines.
+static void reserve_lines(uint n) {
+	if (E.linecap - E.numlines >= n) return;
+	uint cap = MAX(E.numlines + n, E.linecap ? E.linecap * 2 : 64);
+	E.lines = realloc(E.lines, (sizeof *E.lines) * cap);
 	if (!E.lines) DIE("realloc");
 
-	if (at <= LASTLINE)
-		memmove(E.lines + at + 1, E.lines + at,
-		        (sizeof *E.lines) * (E.numlines - at));
+	// Move the lines after the gap to the end of the new array
+	memmove(E.lines + E.gap + cap - E.numlines,
+	        E.lines + E.gap + E.linecap - E.numlines,
+	        (sizeof *E.lines) * (E.numlines - E.gap));
+	E.linecap = cap;
+}
 
-	E.lines[at].len = 0;
-	E.lines[at].chars = strdup("");
+// Appends `n` lines to the end of the table in one go.
+static void append_lines(const Line *lines, uint n) {
+	if (n == 0) return;
+	reserve_lines(n);
+	move_gap(E.numlines);
+	memcpy(E.lines + E.numlines, lines, (sizeof *lines) * n);
+	E.numlines += n;
+	E.gap = E.numlines;
+}
 
-	E.numlines++;
-	E.dirty = true;
+// Keeps a shared buffer until the last snapshot is dropped.
+static void retire(char *chars) {
+	if (E.numretired == E.retiredcap) {
+		E.retiredcap = E.retiredcap ? E.retiredcap * 2 : 64;
+		E.retired = realloc(E.retired, sizeof *E.retired * E.retiredcap);
+		if (!E.retired) DIE("realloc");
+	}
+	E.retired[E.numretired++] = chars;
 }
 
-static void delete_line(uint at) {
-	if (NOLINES) return;
-	if (at >= E.numlines) at = LASTLINE;
+// Whether a snapshot may read the line's buffer. Marks left over from
+// earlier snapshots only cost an extra copy on the next edit.
+static bool shared(const Line *line) {
+	return (line->cap & SHARED) && E.snapshots > 0;
+}
+
+// Copies the lines [from, from + n) for another thread to read. Every buffer
+// in the copy is marked as shared, so that the next edit of a line copies it
+// out (see line_reserve) and the snapshot stays as it was. The table is
+// copied a side of the gap at a time.
+static Line *take_snapshot(uint from, uint n) {
+	Line *lines = malloc(sizeof *lines * MAX(n, 1));
+	if (!lines) DIE("malloc");
+	uint before = from < E.gap ? MIN(n, E.gap - from) : 0;
+	if (before) memcpy(lines, line_at(from), sizeof *lines * before);
+	if (n > before) memcpy(lines + before, line_at(from + before),
+	                       sizeof *lines * (n - before));
+	for (uint i = 0; i < n; i++)
+		if (lines[i].cap) line_at(from + i)->cap |= SHARED;
+	E.snapshots++;
+	return lines;
+}
 
-	free(E.lines[at].chars);
-	E.lines[at].chars = NULL;
+// Once the last snapshot is dropped, the buffers the lines have let go of
+// are freed. The marks stay on the lines; see shared.
+static void drop_snapshot(Line *lines) {
+	free(lines);
+	if (--E.snapshots > 0) return;
+	for (uint i = 0; i < E.numretired; i++) free(E.retired[i]);
+	E.numretired = 0;
+}
 
-	if (at < LASTLINE)
-		memmove(E.lines + at, E.lines + at + 1,
-		        (sizeof *E.lines) * (E.numlines - (at + 1)));
+static void line_free(Line *line) {
+	if (shared(line)) retire(line->chars);
+	else if (line->cap) free(line->chars);
+}
 
-	E.numlines--;
-	E.lines = realloc(E.lines, (sizeof *E.lines) * (E.numlines));
-	if (!E.lines) DIE("realloc");
+// Makes sure the line owns at least `n` bytes of `chars`. Borrowed lines are
+// copied out of the mapped file on their first edit, and shared ones out of
+// a snapshot. Capacity grows geometrically and is never given back,
+// so a run of inserts or deletes at the cursor costs one memmove of the
+// line's tail per key and no allocation.
+static void line_reserve(Line *line, uint n) {
+	const bool owned = line->cap && !shared(line);
+	const uint old = line->cap & ~SHARED;
+	if (owned && n <= old) return;
+	uint cap = MAX(n, MAX(old * 2, MIN_LINE_CAP));
+
+	char *chars = owned ? realloc(line->chars, cap) : malloc(cap);
+	if (!chars) DIE("realloc");
+
+	if (!owned && line->len) memcpy(chars, line->chars, line->len);
+	if (shared(line)) retire(line->chars);
+	line->chars = chars;
+	line->cap = cap;
+}
 
+// --------------------------------- Editing ----------------------------------
+// Every edit of line `y` from column `x` on goes through here. Rows from `y`
+// down have to be redrawn, and the rx checkpoints right of the edit are
+// dropped. Lines below may have moved, so theirs are dropped too.
+static void modified(uint y, uint x) {
 	E.dirty = true;
+	E.generation++;
+	E.damage = MIN(E.damage, y);
+	for (uint i = 0; i < RX_SLOTS; i++) {
+		RxIndex *ix = &E.rx_index[i];
+		if (ix->y > y) ix->len = 0;
+		else if (ix->y == y) ix->len = MIN(ix->len, x / RX_STEP + 1);
+	}
 }
 
-static void split_line(uint at, uint split_at) {
-	if (NOLINES) return;
-	if (at >= E.numlines) return;
-	insert_line(at + 1);
+// The raw edits below don't touch the undo log; they are what the log
+// replays. They keep the match index up to date.
+static void index_lines(uint at, uint n, bool inserted);
+static void index_line(uint y);
+
+// Puts `n` lines at index `at`, taking over their buffers.
+static void put_lines(uint at, const Line *lines, uint n) {
+	reserve_lines(n);
+	move_gap(at);
+	memcpy(E.lines + at, lines, (sizeof *lines) * n);
+	E.numlines += n;
+	E.gap += n;
+	modified(at, 0);
+	index_lines(at, n, true);
+}
 
-	Line *src = E.lines + at;
-	Line *dst = src + 1;
+// Removes `n` lines from index `at` on, into `out` if given.
+static void take_lines(uint at, uint n, Line *out) {
+	// The removed lines are the first ones after the gap; absorb them.
+	move_gap(at);
+	Line *first = E.lines + at + E.linecap - E.numlines;
+	if (out) memcpy(out, first, (sizeof *first) * n);
+	else for (uint i = 0; i < n; i++) line_free(&first[i]);
+	E.numlines -= n;
+	modified(at, 0);
+	index_lines(at, n, false);
+}
 
-	if (split_at >= src->len) return;
+static void put_text(uint y, uint x, const char *s, uint n) {
+	Line *line = line_at(y);
+	line_reserve(line, line->len + n);
+	memmove(&line->chars[x + n], &line->chars[x], line->len - x);
+	memcpy(&line->chars[x], s, n);
+	line->len += n;
+	modified(y, x);
+	index_line(y);
+}
 
-	free(dst->chars);
-	dst->len = src->len - split_at;
-	dst->chars = strndup(src->chars + split_at, dst->len);
+static void take_text(uint y, uint x, uint n) {
+	Line *line = line_at(y);
+	// Cutting off the end of a line doesn't need to own it
+	if (x + n < line->len) {
+		line_reserve(line, line->len);
+		memmove(&line->chars[x], &line->chars[x + n], line->len - x - n);
+	}
+	line->len -= n;
+	modified(y, x);
+	index_line(y);
+}
 
-	// Shorten original line by len
-	src->len -= dst->len;
-	src->chars = realloc(src->chars, src->len);
+static void split_raw(uint y, uint x) {
+	Line *src = line_at(y), dst = {0};
+	if (x < src->len) {
+		dst.len = src->len - x;
+		dst.cap = dst.len + 1;
+		dst.chars = strndup(src->chars + x, dst.len);
+		src->len = x;
+	}
+	put_lines(y + 1, &dst, 1);
+	modified(y, x);
+	index_line(y);
+}
 
-	E.dirty = true;
+static void join_raw(uint y) {
+	Line *dst = line_at(y);
+	const Line *src = line_at(y + 1);
+	uint x = dst->len;
+	if (src->len > 0) {
+		line_reserve(dst, dst->len + src->len);
+		memcpy(dst->chars + dst->len, src->chars, src->len);
+		dst->len += src->len;
+	}
+	take_lines(y + 1, 1, NULL);
+	modified(y, x);
+	index_line(y);
+}
+
+// Grows a text or line array of an edit from `len` to `len + n` elements.
+// Arrays are sized in powers of two, so that coalescing a run of keys into
+// one edit doesn't realloc on every key.
+static void *edit_grow(void *p, uint len, uint n, size_t size) {
+	uint cap = len <= 16 ? 16 : 1u << (32 - __builtin_clz(len - 1));
+	if (p && len + n <= cap) return p;
+	while (cap < len + n) cap *= 2;
+	if (!(p = realloc(p, size * cap))) DIE("realloc");
+	return p;
 }
 
-static void join_lines(uint at) {
-	if (E.numlines <= 1) return;
+static void edit_free(Edit *e) {
+	free(e->text);
+	if (e->lines)
+		for (uint i = 0; i < e->n; i++) line_free(&e->lines[i]);
+	free(e->lines);
+}
+
+// Returns the last edit if the new one may be merged into it, otherwise
+// appends a new one. Anything that was undone is dropped.
+static Edit *record(EditKind kind, bool inserted, uint y, uint x, uint n,
+                    bool (*merges)(const Edit *, uint, uint, uint)) {
+	UndoLog *u = &E.undo;
+	for (; u->len > u->pos; u->len--) edit_free(&u->edits[u->len - 1]);
+
+	Edit *top = u->len ? &u->edits[u->len - 1] : NULL;
+	if (top && top->group == u->group && top->kind == kind &&
+	    top->inserted == inserted && merges && merges(top, y, x, n))
+		return top;
+
+	if (u->len == u->cap) {
+		u->cap = u->cap ? u->cap * 2 : 64;
+		u->edits = realloc(u->edits, sizeof *u->edits * u->cap);
+		if (!u->edits) DIE("realloc");
+	}
+	u->pos = ++u->len;
+	top = &u->edits[u->len - 1];
+	*top = (Edit){kind, inserted, u->group, y, x, 0, NULL, NULL};
+	return top;
+}
+
+// Typing continues after the last insert, `x` deletes at the same place and
+// backspace right before it.
+static bool text_merges(const Edit *e, uint y, uint x, uint n) {
+	if (e->y != y) return false;
+	return e->inserted ? e->x + e->n == x : e->x == x || x + n == e->x;
+}
+
+// Inserted lines continue after the last ones, `dd` deletes at the same
+// line.
+static bool lines_merge(const Edit *e, uint y, uint x, uint n) {
+	(void)x, (void)n;
+	return e->y + (e->inserted ? e->n : 0) == y;
+}
+
+static void record_text(bool inserted, uint y, uint x, const char *s, uint n) {
+	Edit *e = record(EDIT_TEXT, inserted, y, x, n, text_merges);
+	e->text = edit_grow(e->text, e->n, n, 1);
+
+	// Backspace: the deleted text goes in front
+	if (x < e->x) {
+		memmove(e->text + n, e->text, e->n);
+		memcpy(e->text, s, n);
+		e->x = x;
+	} else memcpy(e->text + e->n, s, n);
+	e->n += n;
+}
+
+// Returns where to put the deleted lines, NULL for inserted ones.
+static Line *record_lines(bool inserted, uint y, uint n) {
+	Edit *e = record(EDIT_LINES, inserted, y, 0, n, lines_merge);
+	Line *out = NULL;
+	if (!inserted) {
+		e->lines = edit_grow(e->lines, e->n, n, sizeof *e->lines);
+		out = e->lines + e->n;
+	}
+	e->n += n;
+	return out;
+}
+
+static void insert_line(uint at) {
+	if (at > E.numlines) at = E.numlines;
+
+	// Empty lines don't allocate until something is typed into them
+	put_lines(at, &(Line){0}, 1);
+	record_lines(true, at, 1);
+}
+
+// Lines of a file that is still being indexed are stitched in first, so a
+// count reaches past the lines loaded so far.
+static void stitch_chunks(uint need);
+static void delete_lines(uint at, uint n) {
+	stitch_chunks(at + n);
+	if (NOLINES) return;
 	if (at >= E.numlines) at = LASTLINE;
+	n = MIN(n, E.numlines - at);
 
-	Line *const dst = E.lines + at;
-	const Line *const src = dst + 1;
+	take_lines(at, n, record_lines(false, at, n));
+}
 
-	if (src->len > 0) {
-		const bool add_space = !isspace(src->chars[0]) &&
-		                       !isspace(dst->chars[dst->len - 1]);
-		if (add_space) dst->len++;
+static void split_line(uint at, uint split_at) {
+	if (at >= E.numlines) return;
+	split_at = MIN(split_at, line_at(at)->len);
 
-		dst->chars = realloc(dst->chars, dst->len + src->len);
-		if (!dst->chars) DIE("realloc");
+	split_raw(at, split_at);
+	record(EDIT_BREAK, true, at, split_at, 0, NULL);
+}
+
+// Appends the next line to line `at`, as is.
+static void concat_lines(uint at) {
+	uint x = line_at(at)->len;
+	join_raw(at);
+	record(EDIT_BREAK, false, at, x, 0, NULL);
+}
 
-		if (add_space) dst->chars[dst->len - 1] = ' ';
-		memmove(dst->chars + dst->len, src->chars, src->len);
+// Joins the `n` lines below onto line `at` in a single pass: the line grows
+// once, the text is copied once and the joined lines are removed with one
+// memmove. The edits are recorded as if the lines were joined one by one.
+static void join_lines(uint at, uint n) {
+	stitch_chunks(at + n + 1);
+	if (NOLINES || at >= LASTLINE) return;
+	n = MIN(n, LASTLINE - at);
+
+	Line *dst = line_at(at);
+	const uint x = dst->len;
+	uint len = dst->len;
+	for (uint i = 1; i <= n; i++) len += line_at(at + i)->len + 1;
+	line_reserve(dst, len);
+
+	for (uint i = 1; i <= n; i++) {
+		const Line *src = line_at(at + i);
+		if (src->len > 0 && dst->len > 0 && !isspace(src->chars[0]) &&
+		    !isspace(dst->chars[dst->len - 1])) {
+			record_text(true, at, dst->len, " ", 1);
+			dst->chars[dst->len++] = ' ';
+		}
 
+		record(EDIT_BREAK, false, at, dst->len, 0, NULL);
+		if (src->len) memcpy(dst->chars + dst->len, src->chars, src->len);
 		dst->len += src->len;
 	}
 
-	delete_line(at + 1);
+	take_lines(at + 1, n, NULL);
+	modified(at, x);
+	index_line(at);
+}
 
-	E.dirty = true;
+static void delete_chars(uint at, uint n, Line *line) {
+	if (at >= line->len || n == 0) return;
+	n = MIN(n, line->len - at);
+
+	record_text(false, E.cy, at, line->chars + at, n);
+	take_text(E.cy, at, n);
 }
 
 static void crop_line(uint at) {
 	if (NOLINES) return;
-	CLINE->len = at;
-	E.dirty = true;
+	delete_chars(at, CLINE->len - at, CLINE);
 }
 
 static void line_insert_char(Line *line, uint at, char c) {
 	if (at > line->len) at = line->len;
 
-	line->chars = realloc(line->chars, line->len + 1);
-	if (!line->chars) DIE("realloc");
+	put_text(E.cy, at, &c, 1);
+	record_text(true, E.cy, at, &c, 1);
+}
 
-	memmove(&line->chars[at + 1], &line->chars[at], line->len - at);
+// Appends a byte of a paste to the cursor line. A CR LF breaks it once.
+static void paste_char(char c, char *prev) {
+	if (c == '\r' || (c == '\n' && *prev != '\r')) insert_line(++E.cy);
+	else if (c != '\n') line_insert_char(CLINE, CLINE->len, c);
+	*prev = c;
+}
 
-	line->chars[at] = c;
-	line->len++;
+// Inserts a bracketed paste at the cursor in a single pass: the text after
+// the cursor is split off, the pasted lines are appended to the end of the
+// cursor line (no memmove), and the split off text is joined back at the end.
+// Only the whole closing ESC[201~ ends the paste; a part of it is text.
+static void paste(void) {
+	static const char close[] = "\x1b[201~";
+	if (NOLINES) insert_line(0);
+	split_line(E.cy, E.cx);
+
+	char c = 0, prev = 0;
+	uint k = 0; // bytes of the closing sequence seen so far
+	while (k < sizeof close - 1 && READ(c)) {
+		if (c == close[k]) {
+			k++;
+			continue;
+		}
+		for (uint i = 0; i < k; i++) paste_char(close[i], &prev);
+		k = c == close[0];
+		if (!k) paste_char(c, &prev);
+	}
 
-	E.dirty = true;
+	E.cx = CLINE->len;
+	concat_lines(E.cy);
 }
 
-static void delete_chars(uint at, uint n, Line *line) {
-	if (line->len == 0) return;
-	if (at >= line->len) return;
-	uint end = at + n;
+// ---------------------------------- Undo ------------------------------------
+static void format_message(const char *restrict format, ...);
+// Does (`forward`) or undoes an edit and puts the cursor where it happened.
+static void apply(Edit *e, bool forward) {
+	const bool insert = e->inserted == forward;
+
+	switch (e->kind) {
+	case EDIT_TEXT:
+		if (insert) put_text(e->y, e->x, e->text, e->n);
+		else take_text(e->y, e->x, e->n);
+		break;
+	case EDIT_LINES:
+		if (insert) {
+			put_lines(e->y, e->lines, e->n);
+			free(e->lines);
+			e->lines = NULL;
+		} else {
+			e->lines = edit_grow(NULL, 0, e->n, sizeof *e->lines);
+			take_lines(e->y, e->n, e->lines);
+		}
+		break;
+	case EDIT_BREAK:
+		if (insert) split_raw(e->y, e->x);
+		else join_raw(e->y);
+		break;
+	}
 
-	memmove(&line->chars[at], &line->chars[end], line->len - end);
+	E.cy = e->y;
+	E.cx = e->x;
+}
 
-	line->len -= n;
-	line->chars = realloc(line->chars, line->len);
-	if (!line->chars) DIE("realloc");
+// Undoes the last group of edits.
+static void undo(void) {
+	UndoLog *u = &E.undo;
+	if (u->pos == 0) {
+		format_message("Already at oldest change");
+		return;
+	}
 
-	E.dirty = true;
+	const uint group = u->edits[u->pos - 1].group;
+	while (u->pos > 0 && u->edits[u->pos - 1].group == group)
+		apply(&u->edits[--u->pos], false);
+}
+
+// Redoes the next group of undone edits.
+static void redo(void) {
+	UndoLog *u = &E.undo;
+	if (u->pos == u->len) {
+		format_message("Already at newest change");
+		return;
+	}
+
+	const uint group = u->edits[u->pos].group;
+	while (u->pos < u->len && u->edits[u->pos].group == group)
+		apply(&u->edits[u->pos++], true);
+}
+
+// ---------------------------------- Regex -----------------------------------
+// Patterns are a small ERE: . [...] [^...] \d \w \s, * + ?, | and ( ), and
+// ^ / $ at the very start / end. Any other byte, or one after a '\', stands
+// for itself. They are compiled twice, forwards and backwards, to NFAs that
+// are run as lazily built DFAs, so a line is matched in time linear in its
+// length whatever the pattern.
+#define SLOT(PC, K) ((PC) * 2 + (K))
+#define OUT(G, SLOT) ((G)->insts[(SLOT) / 2].out[(SLOT) % 2])
+#define HAS(SET, I) ((SET)[(I) / 8] & (1 << (I) % 8))
+#define ADD(SET, I) ((SET)[(I) / 8] |= (unsigned char)(1 << (I) % 8))
+
+static int re_inst(Parser *p, InstOp op) {
+	Program *g = p->g;
+	g->insts[g->len] = (Inst){op, {-1, -1}, {0}};
+	return (int)g->len++;
+}
+
+// Points the chain of dangling outs at `to`.
+static void re_patch(Program *g, int chain, int to) {
+	while (chain >= 0) {
+		int next = OUT(g, chain);
+		OUT(g, chain) = to;
+		chain = next;
+	}
+}
+
+static int re_join(Program *g, int a, int b) {
+	if (a < 0) return b;
+	int last = a;
+	while (OUT(g, last) >= 0) last = OUT(g, last);
+	OUT(g, last) = b;
+	return a;
+}
+
+// Adds the class of the escape \c to `set`. Returns false for \d, \w and \s.
+static bool re_escape(unsigned char *set, char c) {
+	const char *class = c == 'd'   ? "09"
+	                    : c == 'w' ? "09azAZ__"
+	                    : c == 's' ? "\t\t  "
+	                               : NULL;
+	if (!class) ADD(set, (unsigned char)c);
+	for (; class && *class; class += 2)
+		for (int i = class[0]; i <= class[1]; i++) ADD(set, i);
+	return !class;
+}
+
+static void re_class(Parser *p, unsigned char *set) {
+	bool negate = p->s < p->end && *p->s == '^';
+	p->s += negate;
+	for (bool first = true; p->s < p->end && (*p->s != ']' || first);
+	     first = false) {
+		unsigned char lo = (unsigned char)*p->s++, hi = lo;
+		if (lo == '\\' && p->s < p->end) {
+			re_escape(set, *p->s++);
+			continue;
+		}
+		if (p->end - p->s >= 2 && p->s[0] == '-' && p->s[1] != ']')
+			hi = (unsigned char)p->s[1], p->s += 2;
+		for (int c = lo; c <= hi; c++) ADD(set, c);
+	}
+	p->error |= p->s == p->end;
+	p->s++;
+	for (int i = 0; negate && i < 32; i++) set[i] = (unsigned char)~set[i];
+}
+
+static Frag re_alt(Parser *p);
+
+static Frag re_atom(Parser *p) {
+	p->atom = -1;
+	if (*p->s == '(') {
+		p->s++, p->depth++;
+		Frag f = re_alt(p);
+		p->error |= p->s == p->end || *p->s != ')';
+		p->s++, p->depth--;
+		p->special = true;
+		p->atom = -1;
+		return f;
+	}
+
+	int pc = re_inst(p, OP_CLASS);
+	unsigned char *set = p->g->insts[pc].set;
+	char c = *p->s++;
+	if (c == '.') memset(set, 0xff, sizeof p->g->insts[pc].set);
+	else if (c == '[') re_class(p, set);
+	else if (c != '\\' || p->s == p->end || re_escape(set, *p->s++))
+		ADD(set, (unsigned char)p->s[-1]), p->atom = p->s[-1];
+	p->special |= p->atom < 0;
+	return (Frag){pc, SLOT(pc, 0)};
+}
+
+// The longest run of plain bytes at the top level is the prefilter literal.
+static void re_flush(Parser *p) {
+	if (p->runlen > p->re->litlen) {
+		memcpy(p->re->lit, p->run, p->runlen);
+		p->re->litlen = p->runlen;
+	}
+	p->runlen = 0;
+}
+
+static Frag re_repeat(Parser *p) {
+	Frag f = re_atom(p);
+	bool repeated = false;
+	while (p->s < p->end && (*p->s == '*' || *p->s == '+' || *p->s == '?')) {
+		const char q = *p->s++;
+		int pc = re_inst(p, OP_SPLIT);
+		p->g->insts[pc].out[0] = f.start;
+		if (q == '?') f.outs = re_join(p->g, f.outs, SLOT(pc, 1));
+		else re_patch(p->g, f.outs, pc), f.outs = SLOT(pc, 1);
+		// x+ still needs an x, x* and x? don't
+		if (q != '+') f.start = pc, p->atom = -1;
+		repeated = p->special = true;
+	}
+
+	if (p->depth == 0 && !p->reverse) {
+		if (p->atom >= 0) p->run[p->runlen++] = (char)p->atom;
+		if (p->atom < 0 || repeated) re_flush(p);
+	}
+	return f;
+}
+
+// Backwards, the parts of a concatenation are chained the other way round.
+static Frag re_concat(Parser *p) {
+	Frag f = {-1, -1};
+	while (p->s < p->end && *p->s != '|' && *p->s != ')') {
+		Frag g = re_repeat(p);
+		if (f.start < 0) f = g;
+		else if (p->reverse) re_patch(p->g, g.outs, f.start), f.start = g.start;
+		else re_patch(p->g, f.outs, g.start), f.outs = g.outs;
+	}
+	if (f.start >= 0) return f;
+
+	int pc = re_inst(p, OP_SPLIT); // matches the empty string
+	return (Frag){pc, SLOT(pc, 0)};
+}
+
+static Frag re_alt(Parser *p) {
+	Frag f = re_concat(p);
+	while (p->s < p->end && *p->s == '|') {
+		p->s++;
+		p->alt |= p->depth == 0;
+		p->special = true;
+		Frag g = re_concat(p);
+		int pc = re_inst(p, OP_SPLIT);
+		p->g->insts[pc].out[0] = f.start;
+		p->g->insts[pc].out[1] = g.start;
+		f = (Frag){pc, re_join(p->g, f.outs, g.outs)};
+	}
+	return f;
+}
+
+static bool re_compile(Regex *re, const char *pattern, uint len) {
+	const char *end = pattern + len;
+	re->litlen = 0;
+	re->bol = len > 0 && *pattern == '^';
+	pattern += re->bol;
+	re->eol = end > pattern && end[-1] == '$' &&
+	          (end - 1 == pattern || end[-2] != '\\');
+	end -= re->eol;
+	const char *engine = getenv("NI_REGEX");
+	re->backtrack = engine && !strcmp(engine, "backtrack");
+
+	for (int reverse = 0; reverse < 2; reverse++) {
+		Program *g = reverse ? &re->rev : &re->fwd;
+		Parser p = {.s = pattern, .end = end, .re = re, .g = g,
+		            .reverse = reverse, .atom = -1};
+		g->len = 0;
+		Frag f = re_alt(&p);
+		if (p.error || p.s != p.end) return re->ok = false;
+
+		re_flush(&p);
+		g->match = re_inst(&p, OP_MATCH);
+		re_patch(g, f.outs, g->match);
+		g->start = f.start;
+		if (reverse) continue;
+		re->plain = !p.special && !re->bol && !re->eol;
+		if (p.alt) re->litlen = 0;
+	}
+	return re->ok = true;
+}
+
+static void dfa_init(Dfa *d, const Program *g, bool restart) {
+	free(d->states);
+	*d = (Dfa){g, restart, NULL, 0, -1};
+}
+
+// Adds instruction `pc` and everything it leads to without a byte.
+static void dfa_closure(const Program *g, unsigned char *set, int pc) {
+	if (pc < 0 || HAS(set, pc)) return;
+	ADD(set, pc);
+	if (g->insts[pc].op != OP_SPLIT) return;
+	dfa_closure(g, set, g->insts[pc].out[0]);
+	dfa_closure(g, set, g->insts[pc].out[1]);
+}
+
+// Returns the state for `set`, adding it if it's new.
+static int dfa_state(Dfa *d, const unsigned char *set) {
+	const size_t size = sizeof d->states->set;
+	for (uint i = 0; i < d->len; i++)
+		if (!memcmp(d->states[i].set, set, size)) return (int)i;
+
+	if (!d->states && !(d->states = calloc(MAX_DFA_STATES, sizeof *d->states)))
+		DIE("calloc");
+	DfaState *s = &d->states[d->len];
+	memcpy(s->set, set, size);
+	memset(s->next, 0, sizeof s->next);
+	s->match = HAS(set, d->prog->match);
+	s->dead = true;
+	for (size_t i = 0; i < size; i++) s->dead &= !set[i];
+	return (int)d->len++;
+}
+
+static int dfa_start(Dfa *d) {
+	if (d->start >= 0) return d->start;
+	unsigned char set[sizeof d->states->set] = {0};
+	dfa_closure(d->prog, set, d->prog->start);
+	return d->start = dfa_state(d, set);
+}
+
+// When the cache is full it is dropped, so the memory stays bounded and
+// every byte still costs at most one pass over the program.
+static int dfa_step(Dfa *d, int s, unsigned char c) {
+	if (d->states[s].next[c]) return d->states[s].next[c] - 1;
+
+	const Program *g = d->prog;
+	unsigned char set[sizeof d->states->set] = {0};
+	for (uint i = 0; i < g->len; i++)
+		if (HAS(d->states[s].set, i) && g->insts[i].op == OP_CLASS &&
+		    HAS(g->insts[i].set, c))
+			dfa_closure(g, set, g->insts[i].out[0]);
+	if (d->restart) dfa_closure(g, set, g->start);
+
+	const bool flush = d->len == MAX_DFA_STATES;
+	if (flush) d->len = 0, d->start = -1;
+	int t = dfa_state(d, set);
+	if (!flush) d->states[s].next[c] = t + 1;
+	return t;
+}
+
+// The baseline: tries every way through the forward program from column i.
+// Nested repeats take exponential time. A run of more splits than there are
+// instructions is a loop that reads nothing.
+static bool backtrack(const Program *g, const char *s, uint len, int pc,
+                      uint i, uint splits) {
+	const Inst *in = &g->insts[pc];
+	switch (in->op) {
+	case OP_MATCH: return !E.search.re.eol || i == len;
+	case OP_CLASS:
+		return i < len && HAS(in->set, (unsigned char)s[i]) &&
+		       backtrack(g, s, len, in->out[0], i + 1, 0);
+	case OP_SPLIT:
+		return splits <= g->len &&
+		       (backtrack(g, s, len, in->out[0], i, splits + 1) ||
+		        (in->out[1] >= 0 &&
+		         backtrack(g, s, len, in->out[1], i, splits + 1)));
+	}
+	return false;
+}
+
+static void push_match(MatchList *l, Match m) {
+	if (l->len == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 64;
+		l->data = realloc(l->data, sizeof *l->data * l->cap);
+		if (!l->data) DIE("realloc");
+	}
+	l->data[l->len++] = m;
+}
+
+// Runs the reverse automaton over s[lo, len) from the end. Returns the first
+// match start in [lo, hi), or with `last` the last one. With `all`, every
+// start in [lo, hi) is appended to it, in order (as line 0).
+static long re_run(Dfa *d, const char *s, uint len, uint lo, uint hi,
+                   bool last, MatchList *all) {
+	const Regex *re = &E.search.re;
+	long found = -1;
+	if (re->backtrack) {
+		for (uint j = lo; j < hi; j++) {
+			uint i = last ? hi - 1 - (j - lo) : j;
+			if ((re->bol && i) ||
+			    !backtrack(&re->fwd, s, len, re->fwd.start, i, 0))
+				continue;
+			if (!all) return i;
+			push_match(all, (Match){0, i});
+		}
+		return -1;
+	}
+
+	const uint n = all ? all->len : 0;
+	int st = dfa_start(d);
+	for (uint i = len;; i--) {
+		if (d->states[st].match && i < hi && (!re->bol || i == 0)) {
+			found = i;
+			if (last) break;
+			if (all) push_match(all, (Match){0, i});
+		}
+		if (i == lo || d->states[st].dead) break;
+		st = dfa_step(d, st, (unsigned char)s[i - 1]);
+	}
+	for (uint a = n, b = all ? all->len : 0; a + 1 < b; a++, b--) {
+		Match t = all->data[a];
+		all->data[a] = all->data[b - 1];
+		all->data[b - 1] = t;
+	}
+	return found;
+}
+
+// Returns the end of the longest match from column `from` that ends by
+// `limit`, or -1.
+static long re_longest(Dfa *d, const char *s, uint len, uint from,
+                       uint limit) {
+	const bool eol = E.search.re.eol;
+	int st = dfa_start(d);
+	long end = d->states[st].match && (!eol || from == len) ? (long)from : -1;
+	for (uint i = from; i < limit && !d->states[st].dead; i++) {
+		st = dfa_step(d, st, (unsigned char)s[i]);
+		if (d->states[st].match && (!eol || i + 1 == len)) end = i + 1;
+	}
+	return end;
+}
+
+// ---------------------------------- Search ----------------------------------
+// Compiles the query and resets the automata of the last one.
+static void compile_query(void) {
+	Search *s = &E.search;
+	if (!re_compile(&s->re, s->query, s->len)) return;
+	dfa_init(&s->rev, &s->re.rev, !s->re.eol);
+	dfa_init(&s->fwd, &s->re.fwd, false);
+}
+
+// Returns the start of the first match of the query in line `y` at or after
+// column `from`, or -1. A line that doesn't contain the literal of a
+// pattern isn't run through the automaton.
+static long find_in_line(uint y, uint from) {
+	const Line *line = line_at(y);
+	const Regex *re = &E.search.re;
+	if (from >= MAX(line->len, 1) || line->len - from < re->litlen) return -1;
+	const char *m = re->litlen ? memmem(line->chars + from, line->len - from,
+	                                    re->lit, re->litlen)
+	                           : NULL;
+	if (re->plain || (re->litlen && !m)) return m ? m - line->chars : -1;
+	return re_run(&E.search.rev, line->chars, line->len, from,
+	              MAX(line->len, 1), false, NULL);
+}
+
+// Returns the start of the last match of the query in line `y` that starts
+// before column `before`, or -1.
+static long rfind_in_line(uint y, uint before) {
+	const Line *line = line_at(y);
+	long last = -1;
+	if (!E.search.re.plain)
+		return re_run(&E.search.rev, line->chars, line->len, 0,
+		              MIN(before, MAX(line->len, 1)), true, NULL);
+	for (long x; (x = find_in_line(y, (uint)(last + 1))) >= 0 && x < before;)
+		last = x;
+	return last;
+}
+
+// Appends every match in `line`, line `y`, to `l`, overlapping ones too, so
+// that n stops where a search would.
+static void all_in_line(Dfa *d, uint y, const Line *line, MatchList *l) {
+	const Regex *re = &E.search.re;
+	const uint n = l->len;
+	if (!re->plain)
+		re_run(d, line->chars, line->len, 0, MAX(line->len, 1), false, l);
+	for (const char *p = line->chars, *end = p + line->len;
+	     re->plain && end - p >= re->litlen &&
+	     (p = memmem(p, (size_t)(end - p), re->lit, re->litlen));
+	     p++)
+		push_match(l, (Match){y, (uint)(p - line->chars)});
+	for (uint i = n; i < l->len; i++) l->data[i].y = y;
+}
+
+// Whether line `b` follows line `a` in the mapped file with only the line
+// break in between. A run of such lines is searched as one block, which
+// saves a call per line. The query can't contain a line break, so no match
+// can span two lines.
+static bool adjacent(const Line *a, const Line *b) {
+	if (a->cap || b->cap || !a->chars || !b->chars) return false;
+	const char *p = a->chars + a->len;
+	for (; p < b->chars && p < a->chars + a->len + 2; p++)
+		if (*p != '\r' && *p != '\n') return false;
+	return p == b->chars;
+}
+
+// Finds the line of the run [y, end) that holds the match at `m`.
+static uint line_of(uint y, uint end, const char *m) {
+	while (end - y > 1) {
+		uint mid = y + (end - y) / 2;
+		if (line_at(mid)->chars <= m) y = mid;
+		else end = mid;
+	}
+	return y;
+}
+
+// Runs the automaton over the lines of the run [a, b), which ends at `to`,
+// that contain the literal of the pattern: the literal is looked for in the
+// rest of the run, and the search goes on from the line it is in.
+static bool match_in_run(uint a, uint b, const char *to, bool forward,
+                         uint *my, uint *mx) {
+	const Regex *re = &E.search.re;
+	bool found = false;
+	for (uint y = a; y < b; y++) {
+		const char *p = line_at(y)->chars;
+		if (re->litlen && (to - p < re->litlen ||
+		                   !(p = memmem(p, (size_t)(to - p), re->lit,
+		                                re->litlen))))
+			break;
+		if (re->litlen) y = line_of(y, b, p);
+
+		long x = forward ? find_in_line(y, 0) : rfind_in_line(y, UINT_MAX);
+		if (x < 0) continue;
+		*my = y, *mx = (uint)x, found = true;
+		if (forward) break;
+	}
+	return found;
+}
+
+// Finds the first (or last) match in lines [y, end), a run of at most
+// SEARCH_RUN bytes of adjacent lines at a time.
+static bool find_in_lines(uint y, uint end, bool forward, uint *my, uint *mx) {
+	const uint q = E.search.re.litlen;
+	while (y < end) {
+		uint a = forward ? y : end - 1, b = a + 1;
+		const char *from = line_at(a)->chars, *to = from + line_at(a)->len;
+		for (; forward && b < end && to - from < SEARCH_RUN &&
+		       adjacent(line_at(b - 1), line_at(b)); b++)
+			to = line_at(b)->chars + line_at(b)->len;
+		for (; !forward && a > y && to - from < SEARCH_RUN &&
+		       adjacent(line_at(a - 1), line_at(a)); a--)
+			from = line_at(a - 1)->chars;
+
+		const char *m = NULL, *p = from;
+		while (E.search.re.plain && to - p >= q &&
+		       (p = memmem(p, (size_t)(to - p), E.search.re.lit, q))) {
+			m = p++;
+			if (forward) break;
+		}
+		if (m) {
+			*my = line_of(a, b, m);
+			*mx = (uint)(m - line_at(*my)->chars);
+			return true;
+		}
+		if (!E.search.re.plain && match_in_run(a, b, to, forward, my, mx))
+			return true;
+
+		if (forward) y = b;
+		else end = a;
+	}
+	return false;
+}
+
+// Moves the cursor to the first match from (y, x) on (or the last one before
+// it), wrapping around the end of the buffer. The lines are searched where
+// they are, nothing is copied.
+static bool search(uint y, uint x, bool forward) {
+	stitch_chunks(UINT_MAX);
+	if (NOLINES || E.search.len == 0) return false;
+	if (!E.search.re.ok) {
+		format_message("Invalid pattern: %.*s", E.search.len, E.search.query);
+		return false;
+	}
+
+	long m = forward ? find_in_line(y, x) : rfind_in_line(y, x + 1);
+	uint my = y, mx = (uint)m;
+	bool found = m >= 0 ||
+	             (forward ? find_in_lines(y + 1, E.numlines, true, &my, &mx) ||
+	                                find_in_lines(0, y + 1, true, &my, &mx)
+	                      : find_in_lines(0, y, false, &my, &mx) ||
+	                                find_in_lines(y, E.numlines, false, &my, &mx));
+	if (!found) {
+		format_message("Pattern not found: %.*s", E.search.len,
+		               E.search.query);
+		return false;
+	}
+
+	E.cy = my;
+	E.cx = mx;
+	return true;
+}
+
+// Collects the starts of the pattern's matches that lie in [from, limit) of
+// `line` in one reverse pass, for find_highlight. A match of a pattern that
+// ends with $ can't end before the end of the line.
+static void highlight_starts(const Line *line, const char *from,
+                             const char *limit) {
+	const Regex *re = &E.search.re;
+	const uint lo = (uint)(from - line->chars);
+	const uint hi = (uint)(limit - line->chars);
+	E.starts.len = 0;
+	E.next_start = 0;
+	if (re->eol && hi < line->len) return;
+	re_run(&E.search.rev, line->chars, re->eol ? line->len : hi, lo, hi,
+	       false, &E.starts);
+}
+
+// Returns the first match that starts in [from, from + span) of `line` and
+// sets `end` to where it ends, or NULL. A pattern only tries the starts
+// highlight_starts found, each with one forward run for the longest match.
+// Matches of a pattern are cut off at the end of the span, and empty ones
+// are skipped.
+static const char *find_highlight(const Line *line, const char *from,
+                                  size_t span, const char **end) {
+	const Regex *re = &E.search.re;
+	const char *m = re->litlen && span >= re->litlen
+	                        ? memmem(from, span, re->lit, re->litlen)
+	                        : NULL;
+	if (re->plain || (re->litlen && !m)) {
+		*end = m ? m + re->litlen : NULL;
+		return m;
+	}
+
+	const uint limit = (uint)(from + span - line->chars);
+	for (; E.next_start < E.starts.len; E.next_start++) {
+		const uint x = E.starts.data[E.next_start].x;
+		if (line->chars + x < from) continue;
+		if (x >= limit) break;
+		long e = re_longest(&E.search.fwd, line->chars, line->len, x, limit);
+		if (e <= x) continue;
+		*end = line->chars + e;
+		return line->chars + x;
+	}
+	return NULL;
+}
+
+// Collects every match in the range. Runs of adjacent lines are searched as
+// one block (see find_in_lines); the matches come in order, so the line of
+// each is found by walking the run once. A pattern runs the automaton `d`
+// over the lines the literal turns up in.
+static void scan_range(MatchIndex *mi, Range *r, Dfa *d) {
+	const Line *lines = mi->lines;
+	const Regex *re = &E.search.re;
+	const uint q = re->litlen;
+	for (uint a = r->start, b; a < r->end && !atomic_load(&mi->cancel);
+	     a = b) {
+		const char *from = lines[a].chars, *to = from + lines[a].len;
+		for (b = a + 1; b < r->end && to - from < SEARCH_RUN &&
+		                adjacent(&lines[b - 1], &lines[b]); b++)
+			to = lines[b].chars + lines[b].len;
+
+		for (const char *p = from; q && to - p >= q &&
+		     (p = memmem(p, (size_t)(to - p), re->lit, q)); p++) {
+			while (a + 1 < b && lines[a + 1].chars <= p) a++;
+			if (re->plain)
+				push_match(&r->found, (Match){a, (uint)(p - lines[a].chars)});
+			else {
+				all_in_line(d, a, &lines[a], &r->found);
+				p = a + 1 < b ? lines[a + 1].chars - 1 : to;
+				a++;
+			}
+		}
+		for (; !q && a < b; a++) all_in_line(d, a, &lines[a], &r->found);
+	}
+}
+
+static void *match_worker(void *arg) {
+	MatchIndex *mi = arg;
+	Dfa rev = {0};
+	dfa_init(&rev, &E.search.re.rev, !E.search.re.eol);
+	while (!atomic_load(&mi->cancel)) {
+		pthread_mutex_lock(&mi->lock);
+		uint i = mi->next++;
+		pthread_mutex_unlock(&mi->lock);
+		if (i >= mi->numranges) break;
+
+		scan_range(mi, &mi->ranges[i], &rev);
+
+		pthread_mutex_lock(&mi->lock);
+		mi->ranges[i].done = true;
+		pthread_cond_signal(&mi->cond);
+		pthread_mutex_unlock(&mi->lock);
+		ssize_t n = write(E.wake_pipe[1], "m", 1);
+		(void)n;
+	}
+	free(rev.states);
+	return NULL;
+}
+
+// Starts the workers on the lines from `from` on.
+static void scan_matches(uint from) {
+	MatchIndex *mi = &E.matches;
+	const uint n = E.numlines - from;
+	mi->upto = from;
+	mi->base = from - (uint)mi->shift;
+	mi->stitched = mi->next = 0;
+	mi->queued = false;
+	mi->skip = 0;
+	mi->qshift = 0;
+	mi->numranges = (n + MATCH_RANGE - 1) / MATCH_RANGE;
+	if (!SCANNING) return;
+
+	mi->lines = take_snapshot(from, n);
+	mi->ranges = calloc(mi->numranges, sizeof *mi->ranges);
+	if (!mi->ranges) DIE("calloc");
+	for (uint i = 0; i < mi->numranges; i++) {
+		mi->ranges[i].start = i * MATCH_RANGE;
+		mi->ranges[i].end = MIN((i + 1) * MATCH_RANGE, n);
+	}
+
+	atomic_store(&mi->cancel, false);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	mi->numthreads = (uint)MIN(MAX(cpus, 1), (long)mi->numranges);
+	mi->threads = malloc(sizeof *mi->threads * mi->numthreads);
+	if (!mi->threads) DIE("malloc");
+	for (uint i = 0; i < mi->numthreads; i++)
+		if (pthread_create(&mi->threads[i], NULL, match_worker, mi))
+			DIE("pthread");
+}
+
+// Stops the workers and drops the ranges that aren't in the index yet.
+static void stop_scan(void) {
+	MatchIndex *mi = &E.matches;
+	if (!mi->threads) return;
+	atomic_store(&mi->cancel, true);
+	for (uint i = 0; i < mi->numthreads; i++)
+		pthread_join(mi->threads[i], NULL);
+	for (uint i = mi->stitched; i < mi->numranges; i++)
+		free(mi->ranges[i].found.data);
+
+	free(mi->threads);
+	free(mi->ranges);
+	mi->threads = NULL;
+	mi->numranges = mi->stitched = 0;
+	drop_snapshot(mi->lines);
+}
+
+// Returns match `i` of the index.
+static Match match_get(uint i) {
+	const MatchIndex *mi = &E.matches;
+	if (i < mi->gap) return mi->matches[i];
+	Match m = mi->matches[i + mi->cap - mi->len];
+	m.y += (uint)mi->shift;
+	return m;
+}
+
+// Moves the gap in front of match `at`.
+static void move_match_gap(uint at) {
+	MatchIndex *mi = &E.matches;
+	Match *after = mi->matches + mi->cap - mi->len;
+	for (; mi->gap > at; mi->gap--) {
+		after[mi->gap - 1] = mi->matches[mi->gap - 1];
+		after[mi->gap - 1].y -= (uint)mi->shift;
+	}
+	for (; mi->gap < at; mi->gap++) {
+		mi->matches[mi->gap] = after[mi->gap];
+		mi->matches[mi->gap].y += (uint)mi->shift;
+	}
+}
+
+// Makes room for `n` more matches.
+static void reserve_matches(uint n) {
+	MatchIndex *mi = &E.matches;
+	if (mi->cap - mi->len >= n) return;
+	uint cap = MAX(mi->len + n, mi->cap ? mi->cap * 2 : 64);
+	mi->matches = realloc(mi->matches, sizeof *mi->matches * cap);
+	if (!mi->matches) DIE("realloc");
+
+	memmove(mi->matches + mi->gap + cap - mi->len,
+	        mi->matches + mi->gap + mi->cap - mi->len,
+	        sizeof *mi->matches * (mi->len - mi->gap));
+	mi->cap = cap;
+}
+
+static void rescan_queued(void);
+
+// Appends the scanned ranges to the index, in order, and the queued lines
+// once it gets to them. Waits for the workers only while fewer than `need`
+// lines are indexed.
+static void stitch_matches(uint need) {
+	MatchIndex *mi = &E.matches;
+	pthread_mutex_lock(&mi->lock);
+	while (SCANNING) {
+		Range *r = &mi->ranges[mi->stitched];
+		if (!r->done && mi->upto >= need) break;
+		if (!r->done) {
+			pthread_cond_wait(&mi->cond, &mi->lock);
+			continue;
+		}
+
+		move_match_gap(mi->len);
+		reserve_matches(r->found.len);
+		for (uint i = 0; i < r->found.len; i++) {
+			Match m = r->found.data[i];
+			if (mi->queued && m.y >= mi->qfrom) {
+				rescan_queued();
+				reserve_matches(r->found.len - i);
+			}
+			if (m.y < mi->skip) continue;
+			m.y += mi->base + (uint)mi->shift;
+			mi->matches[mi->len++] = m;
+			mi->gap = mi->len;
+		}
+		if (mi->queued && r->end >= mi->qfrom) rescan_queued();
+		free(r->found.data);
+		mi->upto = mi->base + (uint)mi->shift + MAX(r->end, mi->skip);
+		mi->stitched++;
+	}
+	pthread_mutex_unlock(&mi->lock);
+	if (!SCANNING) stop_scan();
+}
+
+// Returns the index of the first match at or after (y, x).
+static uint match_at(uint y, uint x) {
+	uint lo = 0, hi = E.matches.len;
+	while (lo < hi) {
+		uint mid = lo + (hi - lo) / 2;
+		Match m = match_get(mid);
+		if (m.y < y || (m.y == y && m.x < x)) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Throws the index away, for a new query.
+static void clear_matches(void) {
+	stop_scan();
+	E.matches.active = false;
+	E.matches.len = E.matches.gap = E.matches.pending = 0;
+	E.matches.shift = 0;
+}
+
+// Indexes every match of the query, scanning in the background.
+static void index_matches(void) {
+	clear_matches();
+	if (E.search.len == 0 || !E.search.re.ok) return;
+	stitch_chunks(UINT_MAX);
+	E.matches.active = true;
+	scan_matches(0);
+}
+
+// Replaces the matches [i, j) with the ones found in the rescanned lines.
+static void splice_found(uint i, uint j) {
+	MatchIndex *mi = &E.matches;
+	move_match_gap(i);
+	mi->len -= j - i;
+	reserve_matches(mi->found.len);
+	if (mi->found.len)
+		memcpy(mi->matches + i, mi->found.data,
+		       sizeof *mi->found.data * mi->found.len);
+	mi->gap += mi->found.len;
+	mi->len += mi->found.len;
+	mi->found.len = 0;
+}
+
+// Drops what is known from line `from` on and scans the rest again.
+static void rescan_from(uint from) {
+	if (E.matches.pending > from) E.matches.pending = 0;
+	stop_scan();
+	splice_found(match_at(from, 0), E.matches.len);
+	scan_matches(from);
+}
+
+// Adds the matches in line `y` of the buffer to `found`.
+static void find_matches(uint y) {
+	all_in_line(&E.search.rev, y, line_at(y), &E.matches.found);
+}
+
+// The snapshot line of line `y` past `upto`. Lines in the queued ones map
+// to the start of them, or to the end with `end`.
+static uint snapshot_line(uint y, bool end) {
+	const MatchIndex *mi = &E.matches;
+	const uint first = mi->base + (uint)mi->shift;
+	if (!mi->queued || y <= first + mi->qfrom) return y - first;
+	if (y >= first + mi->qto + (uint)mi->qshift)
+		return y - first - (uint)mi->qshift;
+	return end ? mi->qto : mi->qfrom;
+}
+
+// Queues the lines past `upto` where `n` lines at `y` were replaced by
+// `n + grow` lines. The workers scan the snapshot on; the queued lines are
+// scanned in the buffer by stitch_matches once it has the lines in front
+// of them. Snapshot lines [qfrom, qto) are now [first + qfrom, first + qto
+// + qshift). Edits far apart give up and scan everything past `upto` again.
+static void queue_lines(uint y, uint n, int grow) {
+	MatchIndex *mi = &E.matches;
+	uint from = snapshot_line(y, false), to = snapshot_line(y + n, true);
+	if (mi->queued) {
+		from = MIN(from, mi->qfrom);
+		to = MAX(to, mi->qto);
+	}
+	mi->qfrom = from;
+	mi->qto = to;
+	mi->qshift += grow;
+	mi->queued = true;
+	if (to - from > MATCH_RANGE) rescan_from(mi->upto);
+}
+
+// Indexes the queued lines, which go right after the ones in the index.
+static void rescan_queued(void) {
+	MatchIndex *mi = &E.matches;
+	const uint first = mi->base + (uint)mi->shift;
+	const uint end = first + mi->qto + (uint)mi->qshift;
+	for (uint y = first + mi->qfrom; y < end; y++) find_matches(y);
+	splice_found(mi->len, mi->len);
+	mi->base += (uint)mi->qshift;
+	mi->skip = mi->qto;
+	mi->qshift = 0;
+	mi->queued = false;
+}
+
+// Rescans the line marked by the last text edit.
+static void flush_pending(void) {
+	MatchIndex *mi = &E.matches;
+	if (!mi->pending) return;
+	const uint y = mi->pending - 1;
+	mi->pending = 0;
+	if (SCANNING && y >= mi->upto) {
+		queue_lines(y, 1, 0);
+		return;
+	}
+
+	find_matches(y);
+	splice_found(match_at(y, 0), match_at(y + 1, 0));
+}
+
+static void index_line(uint y) {
+	if (!E.matches.active) return;
+	if (E.matches.pending != y + 1) flush_pending();
+	E.matches.pending = y + 1;
+}
+
+// Moves the matches after `n` inserted or deleted lines, drops the ones in
+// deleted lines and scans inserted ones, only as far as the lines are
+// indexed. The pending line moves along, or is gone.
+static void index_lines(uint at, uint n, bool inserted) {
+	MatchIndex *mi = &E.matches;
+	if (!mi->active) return;
+	if (mi->pending > at && inserted) mi->pending += n;
+	else if (mi->pending > at + n) mi->pending -= n;
+	else if (mi->pending > at) mi->pending = 0;
+	if (SCANNING && !inserted && at < mi->upto && at + n > mi->upto) {
+		// The indexed lines go first, then the rest is queued
+		const uint k = mi->upto - at;
+		index_lines(at, k, false);
+		index_lines(at, n - k, false);
+		return;
+	}
+	if (SCANNING && at >= mi->upto) {
+		queue_lines(at, inserted ? 0 : n, inserted ? (int)n : -(int)n);
+		return;
+	}
+
+	const uint i = match_at(at, 0);
+	for (uint y = at; inserted && y < at + n; y++) find_matches(y);
+	splice_found(i, inserted ? i : match_at(at + n, 0));
+	mi->upto += inserted ? n : -n;
+	mi->shift += inserted ? (int)n : -(int)n;
+}
+
+// Moves the cursor to the next (or previous) match. Waits for the scan only
+// until the match is known: the next one once a match after the cursor is
+// in the index, the previous one once the cursor line is indexed. Wrapping
+// around needs the whole buffer.
+static void jump_match(bool forward) {
+	MatchIndex *mi = &E.matches;
+	if (!mi->active) return;
+	flush_pending();
+
+	uint i;
+	if (forward) {
+		while ((i = match_at(E.cy, E.cx + 1)) == mi->len && SCANNING)
+			stitch_matches(mi->upto + 1);
+		if (i == mi->len) i = 0;
+	} else {
+		stitch_matches(E.cy + 1);
+		if ((i = match_at(E.cy, E.cx)) == 0) {
+			stitch_matches(UINT_MAX);
+			i = mi->len;
+		}
+		i--;
+	}
+	if (mi->len == 0) {
+		format_message("Pattern not found: %.*s", E.search.len,
+		               E.search.query);
+		return;
+	}
+
+	const Match m = match_get(i);
+	E.cy = m.y;
+	E.cx = m.x;
+	format_message("%c%.*s [%u/%u%s]", E.search.forward ? '/' : '?',
+	               E.search.len, E.search.query, i + 1, mi->len,
+	               SCANNING ? "+" : "");
+}
+
+// Picks up the ranges the workers are done with and shows the count so far.
+static void poll_matches(void) {
+	flush_pending();
+	if (!SCANNING) return;
+	uint len = E.matches.len;
+	stitch_matches(0);
+	if (E.matches.len != len || !SCANNING)
+		format_message("%c%.*s: %u%s matches", E.search.forward ? '/' : '?',
+		               E.search.len, E.search.query, E.matches.len,
+		               SCANNING ? "+" : "");
 }
 
 // ---------------------------------- Input -----------------------------------
-static void cursor_move(int c) {
+// Moves the cursor `n` steps at once.
+static void cursor_move(int c, uint n) {
 	switch (c) {
 
 	case 'k':
-	case KEY_UP: E.cy > 0 && E.cy--; break;
+	case KEY_UP: E.cy -= MIN(n, E.cy); break;
 
 	case 'j':
 	case KEY_DOWN:
-		if (!NOLINES && E.cy < LASTLINE) E.cy++;
+		stitch_chunks(E.cy + n + 1);
+		if (!NOLINES) E.cy = MIN(E.cy + n, LASTLINE);
 		break;
 
 	case 'h':
-	case KEY_LEFT: E.cx > 0 && E.cx--; break;
+	case KEY_LEFT: E.cx -= MIN(n, E.cx); break;
 
 	case 'l':
 	case KEY_RIGHT:
-		if (!NOLINES && E.cx < ENDOFLINE) E.cx++;
+		if (!NOLINES && CLINE->len) E.cx = MIN(E.cx + n, ENDOFLINE);
 		break;
 
 	default: return;
@@ -428,28 +2017,25 @@ static void cursor_normalize(void) {
 		return;
 	}
 
-	uint max_y = LASTLINE;
+	// The line has to be clamped before it is looked at
+	if (E.cy > LASTLINE) E.cy = LASTLINE;
 	uint max_x = CLINE->len == 0 ? 0 : ENDOFLINE;
-
-	if (E.cy > max_y) E.cy = max_y;
 	if (E.cx > max_x) E.cx = max_x;
 }
 
-static void format_message(const char *restrict format, ...);
+// Doesn't wait for the index; the count is marked with a '+' while there
+// are chunks left.
 static void show_file_info(void) {
-	if (E.numlines > 0)
-		format_message(
-			"\"%s\" %d lines, --%.0f%%--",
-			E.filename ? E.filename : "[NO NAME]", E.numlines,
-			((double)E.cy + 1) / (double)E.numlines * 100);
-	else
-		format_message(
-			"\"%s\" --No lines in buffer--",
-			E.filename ? E.filename : "[NO NAME]");
+	double pct = NOLINES ? 0 : ((double)E.cy + 1) / E.numlines * 100;
+	format_message(
+		"\"%s\" %u%s lines, --%.0f%%-- latency p50 %lu p99 %lu max %lu us",
+		E.filename ? E.filename : "[NO NAME]", E.numlines,
+		E.stitched < E.numchunks ? "+" : "", pct,
+		percentile(50), percentile(99), E.latency_max);
 }
 
 static uint find_word(uint x, const Line *line) {
-	if (x >= line->len - 1) return x;
+	if (x + 1 >= line->len) return x;
 
 	// Consume current word
 	while (x < line->len - 1 && isalnum(line->chars[x])) x++;
@@ -461,7 +2047,7 @@ static uint find_word(uint x, const Line *line) {
 }
 
 static uint find_end(uint x, const Line *line) {
-	if (x >= line->len - 1) return x;
+	if (x + 1 >= line->len) return x;
 
 	// Consume whitespace to the right
 	if (!isalnum(line->chars[x + 1]))
@@ -516,6 +2102,16 @@ static uint repeat_find(uint x, const Line *line, bool same_direction) {
 	return find_char_in_line(x, line, E.find.c, forward);
 }
 
+static void start_search(bool forward) {
+	clear_matches();
+	free(E.search.fwd.states);
+	free(E.search.rev.states);
+	E.search = (Search){.forward = forward, .y = E.cy, .x = E.cx};
+	E.mode = MODE_SEARCH;
+	E.damage = 0; // drop the old highlights
+	format_message("%c", forward ? '/' : '?');
+}
+
 static void enter_insert_mode(char c) {
 	if (!E.numlines) insert_line(0);
 
@@ -530,38 +2126,43 @@ static void enter_insert_mode(char c) {
 	E.mode = MODE_INSERT;
 }
 
-static void delete_motion(char c) {
+// Deletes over `n` repetitions of the motion, in one go.
+static void delete_motion(char c, uint n) {
 	Line *line = CLINE;
-	uint start, end;
-
-	switch (c) {
-	case 'w':
-		start = E.cx;
-		end = find_word(E.cx, line);
-		break;
-	case 'e':
-		start = E.cx;
-		end = find_end(E.cx, line) + 1;
-		break;
-	case 'b':
-		start = find_word_backwards(E.cx, line);
-		end = E.cx;
-		break;
-	case 'E':
-		start = find_end_backwards(E.cx, line);
-		end = E.cx;
-		break;
-
-	default: return;
-	}
+	uint start = E.cx, end = E.cx;
+
+	for (; n > 0; n--) switch (c) {
+		case 'w': end = find_word(end, line); break;
+		case 'e': end = find_end(end, line); break;
+		case 'b': start = find_word_backwards(start, line); break;
+		case 'E': start = find_end_backwards(start, line); break;
+		default: return;
+		}
+	if (c == 'e') end++;
 
 	delete_chars(start, end - start, line);
 	E.cx = start;
 }
 
-static void editor_save(void);
+static bool editor_save(void);
+static void wait_save(void);
 
 static void process_key_normal(const int c) {
+	// A count is read before the chord and after an operator; '0' only
+	// continues one
+	const bool op = E.chord.len == 1 &&
+	                (E.chord.keys[0] == 'd' || E.chord.keys[0] == 'c');
+	uint *digits = op ? &E.chord.motion : &E.chord.count;
+	if ((E.chord.len == 0 || op) && isdigit(c) && (c != '0' || *digits)) {
+		*digits = MIN(*digits * 10 + (uint)(c - '0'), MAX_COUNT);
+		return;
+	}
+	// Both counts multiply: 2d3w deletes six words
+	const uint count = E.chord.count;
+	uint n = (uint)MIN((unsigned long)MAX(count, 1) * MAX(E.chord.motion, 1),
+	                   MAX_COUNT);
+
+	if (E.chord.len == 0) E.undo.group++;
 	E.chord.keys[E.chord.len++] = (char)c;
 	if (E.chord.len == 1) {
 		switch (c) {
@@ -569,6 +2170,8 @@ static void process_key_normal(const int c) {
 		case CTRL_KEY('q'): quit(EXIT_FAILURE);
 		case CTRL_KEY('s'): editor_save(); break;
 		case CTRL_KEY('g'): show_file_info(); break;
+		case CTRL_KEY('p'): E.profiling = !E.profiling; break;
+		case KEY_PASTE: paste(); break;
 
 		// Enter INSERT mode
 		case 'i':
@@ -581,18 +2184,12 @@ static void process_key_normal(const int c) {
 		case CTRL_KEY('h'):
 			if (E.coloff > 0) E.coloff--;
 			break;
-		case CTRL_KEY('e'): E.rowoff++; break;
-		case CTRL_KEY('y'):
-			if (E.rowoff > 0) E.rowoff--;
-			break;
+		case CTRL_KEY('e'): E.rowoff += n; break;
+		case CTRL_KEY('y'): E.rowoff -= MIN(n, E.rowoff); break;
 
 		// Jump half-screen up/down
-		case CTRL_KEY('d'):
-			for (uint n = E.rows / 2; n > 0; n--) cursor_move('j');
-			break;
-		case CTRL_KEY('u'):
-			for (uint n = E.rows / 2; n > 0; n--) cursor_move('k');
-			break;
+		case CTRL_KEY('d'): cursor_move('j', E.rows / 2); break;
+		case CTRL_KEY('u'): cursor_move('k', E.rows / 2); break;
 
 		// Start/End of line
 		case '0': E.cx = 0; break;
@@ -601,28 +2198,36 @@ static void process_key_normal(const int c) {
 			break;
 
 		// Word wise movement
-		case 'w': E.cx = find_word(E.cx, CLINE); break;
-		case 'b': E.cx = find_word_backwards(E.cx, CLINE); break;
-		case 'e': E.cx = find_end(E.cx, CLINE); break;
+		case 'w':
+			for (; n && !NOLINES; n--) E.cx = find_word(E.cx, CLINE);
+			break;
+		case 'b':
+			for (; n && !NOLINES; n--)
+				E.cx = find_word_backwards(E.cx, CLINE);
+			break;
+		case 'e':
+			for (; n && !NOLINES; n--) E.cx = find_end(E.cx, CLINE);
+			break;
 
 		// Jumps
-		case 'G': E.cy = LASTLINE; break;
+		case 'G':
+			stitch_chunks(count ? count : UINT_MAX);
+			E.cy = count ? MIN(count - 1, LASTLINE) : LASTLINE;
+			break;
 
 		// Inserting lines
 		case 'O':
-			E.cx = 0;
 			insert_line(E.cy);
-			E.mode = MODE_INSERT;
+			enter_insert_mode('I');
 			break;
 		case 'o':
-			E.cx = 0;
 			if (NOLINES) insert_line(E.cy);
-			else insert_line(E.cy++ + 1);
-			E.mode = MODE_INSERT;
+			else insert_line(++E.cy);
+			enter_insert_mode('I');
 			break;
 
 		// Join lines
-		case 'J': join_lines(E.cy); break;
+		case 'J': join_lines(E.cy, MAX(n, 2) - 1); break;
 
 		// Deleting
 		case 'D': crop_line(E.cx--); break;
@@ -634,11 +2239,27 @@ static void process_key_normal(const int c) {
 			break;
 
 		// Delete single character
-		case 'x': delete_chars(E.cx, 1, CLINE); break;
+		case 'x': delete_chars(E.cx, n, CLINE); break;
+
+		// Search
+		case '/':
+		case '?': start_search(c == '/'); break;
+		case 'n':
+		case 'N':
+			for (bool fw = E.search.forward == (c == 'n'); n > 0; n--)
+				jump_match(fw);
+			break;
+
+		// Undo / redo
+		case 'u': undo(); break;
+		case CTRL_KEY('r'): redo(); break;
 
 		// Search in line
 		case ';':
-		case ',': E.cx = repeat_find(E.cx, CLINE, c == ';'); break;
+		case ',':
+			for (; n && !NOLINES; n--)
+				E.cx = repeat_find(E.cx, CLINE, c == ';');
+			break;
 
 		case 'c':
 		case 'd':
@@ -647,29 +2268,39 @@ static void process_key_normal(const int c) {
 		case 'F':
 		case 'Z': return;
 
-		default: cursor_move(c); break;
+		default: cursor_move(c, n); break;
 		}
 	} else if (E.chord.len == 2) {
 		switch (E.chord.keys[0]) {
 		case 'Z':
 			switch (c) {
-			case 'Z': editor_save(); quit(EXIT_SUCCESS);
+			case 'Z':
+				if (!editor_save()) break;
+				wait_save();
+				if (!E.save.error) quit(EXIT_SUCCESS);
+				break;
 			case 'Q': quit(EXIT_SUCCESS);
 			}
 
 		case 'g':
 			switch (c) {
-			case 'g': E.cy = 0; break;
-			case 'e': E.cx = find_end_backwards(E.cx, CLINE); break;
+			case 'g':
+				stitch_chunks(count);
+				E.cy = count ? count - 1 : 0;
+				break;
+			case 'e':
+				for (; n && !NOLINES; n--)
+					E.cx = find_end_backwards(E.cx, CLINE);
+				break;
 			}
 			break;
 
 		case 'd':
 			switch (c) {
-			case 'd': delete_line(E.cy); break;
+			case 'd': delete_lines(E.cy, n); break;
 			case 'w':
 			case 'e':
-			case 'b': delete_motion((char)c); break;
+			case 'b': delete_motion((char)c, n); break;
 			case '0':
 				delete_chars(0, E.cx, CLINE);
 				E.cx = 0;
@@ -688,7 +2319,7 @@ static void process_key_normal(const int c) {
 			switch (c) {
 			case 'w':
 			case 'e':
-			case 'b': delete_motion((char)c); break;
+			case 'b': delete_motion((char)c, n); break;
 			case '0':
 				delete_chars(0, E.cx, CLINE);
 				E.cx = 0;
@@ -706,8 +2337,8 @@ static void process_key_normal(const int c) {
 			if (isprint(c) || isblank(c)) {
 				E.find.forward = E.chord.keys[0] == 'f';
 				E.find.c = (char)c;
-				E.cx = find_char_in_line(
-					E.cx, CLINE, E.find.c, E.find.forward);
+				for (; n && !NOLINES; n--)
+					E.cx = repeat_find(E.cx, CLINE, true);
 			}
 			break;
 		}
@@ -717,27 +2348,27 @@ static void process_key_normal(const int c) {
 			switch (E.chord.keys[1]) {
 			case 'g':
 				switch (c) {
-				case 'e': delete_motion('E'); break;
+				case 'e': delete_motion('E', n); break;
 				}
 				break;
 			case 'f':
 				if (isprint(c) || isblank(c)) {
 					E.find.forward = true;
 					E.find.c = (char)c;
-					uint target = find_char_in_line(
-						E.cx, CLINE, E.find.c, true);
-					delete_chars(
-						E.cx, target + 1 - E.cx, CLINE);
+					uint target = E.cx;
+					for (; n; n--)
+						target = repeat_find(target, CLINE, true);
+					delete_chars(E.cx, target + 1 - E.cx, CLINE);
 				}
 				break;
 			case 'F':
 				if (isprint(c) || isblank(c)) {
 					E.find.forward = false;
 					E.find.c = (char)c;
-					uint target = find_char_in_line(
-						E.cx, CLINE, E.find.c, false);
-					delete_chars(
-						target, E.cx - target, CLINE);
+					uint target = E.cx;
+					for (; n; n--)
+						target = repeat_find(target, CLINE, true);
+					delete_chars(target, E.cx - target, CLINE);
 					E.cx = target;
 				}
 				break;
@@ -747,6 +2378,8 @@ static void process_key_normal(const int c) {
 	}
 
 	E.chord.len = 0;
+	E.chord.count = 0;
+	E.chord.motion = 0;
 }
 
 static void process_key_insert(const int c) {
@@ -762,6 +2395,8 @@ static void process_key_insert(const int c) {
 		delete_chars(--E.cx, 1, CLINE);
 		break;
 
+	case KEY_PASTE: paste(); break;
+
 	case KEY_RETURN:
 		split_line(E.cy, E.cx);
 		E.cy++;
@@ -775,39 +2410,124 @@ static void process_key_insert(const int c) {
 	}
 }
 
-static struct timespec process_key(void) {
-	int key = read_key();
-	struct timespec key_received_at = get_current_time();
+// Leaves the search at the match of the query, or where it started when
+// the query is empty or not found.
+static void end_search(void) {
+	Search *s = &E.search;
+	E.mode = MODE_NORMAL;
+	E.damage = 0;
+	if (s->len && search(s->y, s->x, s->forward)) index_matches();
+	else E.cy = s->y, E.cx = s->x;
+}
+
+// Every key of the query searches again from where the search started.
+static void process_key_search(const int c) {
+	Search *s = &E.search;
+	switch (c) {
+	case KEY_DELETE:
+		if (s->len == 0) {
+			end_search();
+			return;
+		}
+		s->len--;
+		break;
 
-	switch (E.mode) {
-	case MODE_NORMAL: {
-		process_key_normal(key);
-		if (E.mode == MODE_NORMAL) cursor_normalize();
-	} break;
-	case MODE_INSERT: {
-		process_key_insert(key);
-	} break;
+	case KEY_ESCAPE:
+		s->len = 0;
+		end_search();
+		return;
+
+	case KEY_RETURN: end_search(); return;
+
+	default:
+		if (s->len == MAX_QUERY || !(isprint(c) || isblank(c))) return;
+		s->query[s->len++] = (char)c;
+		break;
 	}
 
-	return key_received_at;
+	E.damage = 0;
+	E.cy = s->y, E.cx = s->x;
+	compile_query();
+	if (s->len) search(s->y, s->x, s->forward);
+	format_message("%c%.*s", s->forward ? '/' : '?', s->len, s->query);
 }
 
-static uint cx2rx(uint cx, Line *line) {
-	if (!line->len) return cx;
+static void process_key(void) {
+	int key;
+	PROFILE("read_key", key = read_key());
+	if (key == KEY_NOOP) return;
+	if (E.keys++ == 0) E.received = get_current_time();
 
-	const char *chars = line->chars;
-	uint rx = 0;
+	if (E.mode == MODE_INSERT) PROFILE("edit", process_key_insert(key));
+	else if (E.mode == MODE_SEARCH) PROFILE("edit", process_key_search(key));
+	else PROFILE("edit", process_key_normal(key));
+	if (E.mode == MODE_NORMAL) cursor_normalize();
+}
 
-	for (uint i = 0; i < cx; i++) {
-		if (chars[i] == '\t') rx += TABSTOP - (rx % TABSTOP);
-		else rx++;
+// Returns the render column of column `to` of the line, given the one of
+// column `from`. Tab-free runs are skipped a memchr at a time.
+static uint rx_advance(const Line *line, uint from, uint to, uint rx) {
+	const char *s = line->chars + from, *end = line->chars + to, *tab;
+	for (; s < end; s = tab + 1) {
+		if (!(tab = memchr(s, '\t', (size_t)(end - s))))
+			return rx + (uint)(end - s);
+		rx += (uint)(tab - s);
+		rx += TABSTOP - rx % TABSTOP;
 	}
-
 	return rx;
 }
 
+// Returns the rx checkpoints of line `y`, known at least up to column `cx`.
+static RxIndex *rx_index(uint y, const Line *line, uint cx) {
+	RxIndex *ix = &E.rx_index[y % RX_SLOTS];
+	if (ix->y != y) {
+		ix->y = y;
+		ix->len = 0;
+	}
+	const uint need = cx / RX_STEP + 1;
+	if (need > ix->cap) {
+		ix->cap = MAX(need, ix->cap * 2);
+		ix->rx = realloc(ix->rx, sizeof *ix->rx * ix->cap);
+		if (!ix->rx) DIE("realloc");
+	}
+
+	if (ix->len == 0) ix->rx[ix->len++] = 0;
+	for (; ix->len < need; ix->len++)
+		ix->rx[ix->len] = rx_advance(line, (ix->len - 1) * RX_STEP,
+		                             ix->len * RX_STEP, ix->rx[ix->len - 1]);
+	return ix;
+}
+
+// Returns the column of the last checkpoint of line `y` at or left of render
+// column `rx` and sets `at` to its render column. Checkpoints are added up
+// to there, then found with a binary search.
+static uint rx_seek(uint y, const Line *line, uint rx, uint *at) {
+	RxIndex *ix = rx_index(y, line, 0);
+	while (ix->rx[ix->len - 1] <= rx && ix->len * RX_STEP <= line->len)
+		rx_index(y, line, ix->len * RX_STEP);
+
+	uint lo = 0, hi = ix->len;
+	while (hi - lo > 1) {
+		uint mid = lo + (hi - lo) / 2;
+		if (ix->rx[mid] <= rx) lo = mid;
+		else hi = mid;
+	}
+	*at = ix->rx[lo];
+	return lo * RX_STEP;
+}
+
+// Starts from the checkpoint left of `cx`, so moving and editing anywhere
+// on a long line walk at most RX_STEP columns.
+static uint cx2rx(uint cx, uint y) {
+	const Line *line = line_at(y);
+	if (!line->len) return cx;
+
+	const uint k = cx / RX_STEP;
+	return rx_advance(line, k * RX_STEP, cx, rx_index(y, line, cx)->rx[k]);
+}
+
 static void editor_scroll(void) {
-	E.rx = E.cy < E.numlines ? cx2rx(E.cx, CLINE) : E.cx;
+	E.rx = E.cy < E.numlines ? cx2rx(E.cx, E.cy) : E.cx;
 	if (E.cy < E.rowoff) E.rowoff = E.cy;
 	if ((E.cy + 1) > E.rowoff + (E.rows - NUM_UTIL_LINES))
 		E.rowoff = (E.cy + 1) - (E.rows - NUM_UTIL_LINES);
@@ -832,195 +2552,279 @@ static void format_message(const char *restrict format, ...) {
 }
 #pragma clang diagnostic pop
 
-static int screen_append(ScreenBuffer *screen, const char s[], size_t len) {
-	if (screen->len + len > MAX_SCREEN_LEN) return -1;
+// The screen buffer grows to fit the largest frame and is never shrunk.
+static void screen_grow(ScreenBuffer *screen, size_t n) {
+	screen->cap = MAX(screen->len + n, MAX(screen->cap * 2, MIN_SCREEN_CAP));
+	screen->data = realloc(screen->data, screen->cap);
+	if (!screen->data) DIE("realloc");
+}
 
-	memcpy(&screen->data[screen->len], s, len);
-	screen->len += len;
+// Returns room for `n` more bytes at the end of the screen buffer.
+static char *screen_reserve(ScreenBuffer *screen, size_t n) {
+	if (screen->len + n > screen->cap) screen_grow(screen, n);
 
-	return 0;
+	screen->copies++;
+	screen->len += n;
+	return screen->data + screen->len - n;
+}
+
+static void screen_append(ScreenBuffer *screen, const char s[], size_t len) {
+	memcpy(screen_reserve(screen, len), s, len);
+}
+
+// Appends `n` times `c` in one go, for padding and tabs.
+static void screen_fill(ScreenBuffer *screen, char c, size_t n) {
+	memset(screen_reserve(screen, n), c, n);
+}
+
+// Sends the frame in chunks of at most MAX_WRITE bytes, picking up after
+// partial writes and interrupted calls.
+static void screen_flush(ScreenBuffer *screen) {
+	for (size_t done = 0; done < screen->len; screen->writes++) {
+		ssize_t n = write(STDOUT_FILENO, screen->data + done,
+		                  MIN(screen->len - done, MAX_WRITE));
+		if (n < 0 && errno != EINTR) return;
+		if (n > 0) done += (size_t)n;
+	}
 }
 
 static void draw_welcome_message(ScreenBuffer *screen) {
-	uint max_len = E.cols - 1;
 	char buf[80];
-	int required_len = snprintf(
-		buf, sizeof buf, "ni editor -- version %s", NI_VERSION);
-	if (required_len == -1) DIE("snprintf");
-	uint len = (uint)required_len > max_len ? max_len : (uint)required_len;
-	uint padding = (max_len - len) / 2;
-	while (padding--) screen_append(screen, " ", 1);
-	screen_append(screen, buf, len);
+	int len = snprintf(buf, sizeof buf, "ni editor -- version %s", NI_VERSION);
+	if (len == -1) DIE("snprintf");
+	len = MIN(len, (int)E.cols - 1);
+	screen_fill(screen, ' ', (size_t)MAX(((int)E.cols - 1 - len) / 2, 0));
+	screen_append(screen, buf, (size_t)len);
 }
 
 static int draw_status(ScreenBuffer *screen) {
-	const int max_len = (int)E.cols;
+	const bool normal = E.mode == MODE_NORMAL;
+	const char *modes[] = {"NORMAL", "INSERT", "SEARCH"};
+	char mode[48], file[128], cursor[24];
 
-	char mode_buf[32];
 	int mode_len = snprintf(
-		mode_buf, sizeof mode_buf - 1, " --- %s --- ",
-		E.mode == MODE_NORMAL ? "NORMAL" : "INSERT");
-	if (mode_len == -1) return -1;
-	if (mode_len < (int)sizeof mode_buf && E.mode == MODE_NORMAL) {
-		int chord_len = snprintf(
-			mode_buf + mode_len,
-			sizeof mode_buf - 1 - (size_t)mode_len, "%.*s",
-			E.chord.len, E.chord.keys);
-		if (chord_len == -1) return -1;
-		mode_len += chord_len;
-	}
-
-	mode_len = MIN(mode_len, (int)sizeof mode_buf);
-
-	char cursor_buf[12];
-	int cursor_len = snprintf(
-		cursor_buf, sizeof cursor_buf - 1, "[%d:%d]", E.cy + 1,
-		E.cx + 1);
-	if (cursor_len == -1) return -1;
-	cursor_len = MIN(cursor_len, (int)sizeof cursor_buf);
-
-	char filename_buf[128];
-	int filename_len = snprintf(
-		filename_buf, sizeof filename_buf - 1, "%s%s",
-		E.filename == NULL ? "[NO NAME]" : E.filename,
+		mode, sizeof mode, " --- %s --- %.0u%.*s%.0u",
+		modes[E.mode], normal ? E.chord.count : 0,
+		normal ? (int)E.chord.len : 0, E.chord.keys,
+		normal ? E.chord.motion : 0);
+	int file_len = snprintf(
+		file, sizeof file, "%s%s", E.filename ? E.filename : "[NO NAME]",
 		E.dirty ? " [+]" : "");
-	if (filename_len == -1) return -1;
-	filename_len = MIN(filename_len, (int)sizeof filename_buf);
-
-	const int total_len = mode_len + filename_len + cursor_len;
-	if (max_len < total_len) {
+	int cursor_len =
+		snprintf(cursor, sizeof cursor, "[%u:%u]", E.cy + 1, E.cx + 1);
+	if (mode_len < 0 || file_len < 0 || cursor_len < 0) return -1;
+	file_len = MIN(file_len, (int)sizeof file - 1);
+
+	// Mode to the left, cursor to the right and the file name in between
+	int padding = (int)E.cols - mode_len - file_len - cursor_len;
+	if (padding < 0) {
 		char msg[] = "!!! ERROR: Status too long !!!";
-		screen_append(screen, msg, sizeof msg);
+		screen_append(screen, msg, sizeof msg - 1);
 		return -1;
 	}
 
-	// clang-format off
-	struct { char *s;  int len; } parts[] = {
-		{mode_buf,     mode_len},
-		{filename_buf, filename_len},
-		{cursor_buf,   cursor_len}
-	};
-	// clang-format on
-
-	const int n_parts = sizeof parts / sizeof parts[0];
-	const int padding = (max_len - total_len) / (n_parts - 1);
-	int remaining = max_len;
-
 	screen_append(screen, "\x1b[7m", 4);
-	for (int i = 0; i < n_parts; i++) {
-		const char *part = parts[i].s;
-		const uint len = (uint)parts[i].len;
-
-		remaining -= len;
-		if (i > 0) {
-			int pad = padding;
-			remaining -= pad;
-			if (i == n_parts - 1)
-				while (remaining-- > 0) pad++;
-			while (pad-- > 0) screen_append(screen, " ", 1);
-		}
-		screen_append(screen, part, len);
-	}
+	screen_append(screen, mode, (size_t)mode_len);
+	screen_fill(screen, ' ', (size_t)(padding / 2));
+	screen_append(screen, file, (size_t)file_len);
+	screen_fill(screen, ' ', (size_t)(padding - padding / 2));
+	screen_append(screen, cursor, (size_t)cursor_len);
 	screen_append(screen, "\x1b[0m", 4);
 
 	return 0;
 }
 
-static unsigned long total_microseconds(const struct timespec *ts) {
-	if (ts == NULL) return 0;
+// The stats of the last frame are shown right of the message while the
+// profiler is on, in whatever space the message leaves.
+static int draw_message(ScreenBuffer *screen) {
+	size_t msg_len = MIN(E.message.len, E.cols);
+	screen_append(screen, E.message.data, msg_len);
+	if (!E.profiling) return 0;
+
+	char stats[96];
+	int len = snprintf(
+		stats, sizeof stats, " %u keys %lu us (%lu us/key) %zu B %u wr %u cp",
+		E.batch, E.latency, E.latency / MAX(E.batch, 1), E.written,
+		E.frame_writes, E.frame_copies);
+	if (len < 0 || (uint)len >= sizeof stats) return 0;
+
+	size_t remaining = E.cols - msg_len;
+	size_t stats_len = MIN((size_t)len, remaining);
+	screen_fill(screen, ' ', remaining - stats_len);
+	screen_append(screen, stats, stats_len);
 
-	return ((unsigned long)ts->tv_sec * 1000000000ul +
-	        (unsigned long)ts->tv_nsec) /
-	       1000;
+	return 0;
 }
 
-static int draw_message(ScreenBuffer *screen, const struct timespec *duration) {
-	char duration_msg[32];
-	int duration_len = snprintf(
-		duration_msg, sizeof duration_msg, " %lu us",
-		total_microseconds(duration));
-	if (duration_len < 0) return 0;
-
-	if ((uint)duration_len >= sizeof duration_msg)
-		duration_len = sizeof duration_msg;
+// Renders the visible part of line `y` straight into the screen. The text
+// left of `coloff` is skipped from the last rx checkpoint before it, a
+// tab-free run at a time, so the cost depends on the screen width and
+// RX_STEP, not the line length.
+static void draw_line(ScreenBuffer *screen, uint y) {
+	const Line *line = line_at(y);
+	uint rx, w = 0, n;
+	const char *s = line->chars + rx_seek(y, line, E.coloff, &rx);
+	const char *end = line->chars + line->len, *tab;
+
+	while (s < end && rx < E.coloff) {
+		n = MIN((uint)(end - s), E.coloff - rx);
+		if ((tab = memchr(s, '\t', n))) n = (uint)(tab - s);
+		s += n, rx += n;
+		if (tab) s++, rx += TABSTOP - rx % TABSTOP;
+	}
 
-	int remaining = (int)E.cols - duration_len;
-	if (remaining < 0) return 0;
+	// The rest of a tab that started left of the window
+	if (rx > E.coloff) w = MIN(rx - E.coloff, E.cols);
+	screen_fill(screen, E.render_tab_characters[1], w);
+
+	// Matches of the search are highlighted. Only the bytes that can still
+	// show up in the window are searched, starting with a match that may
+	// have begun left of it.
+	// A pattern may match anything up to a screen wide.
+	const Regex *re = &E.search.re;
+	const uint q = !E.search.len || !re->ok ? 0
+	               : re->plain              ? re->litlen
+	                                        : E.cols;
+	const char *from = s - MIN((uint)(s - line->chars), q ? q - 1 : 0);
+	const char *hl = line->chars, *hl_end = hl;
+	bool lit = false;
+	if (q && !re->plain)
+		highlight_starts(line, from, from + MIN((size_t)(end - from),
+		                 (size_t)(s - from) + E.cols - w + q));
+
+	while (s < end && w < E.cols) {
+		if (lit && s == hl_end) screen_append(screen, "\x1b[27m", 5);
+		lit = lit && s < hl_end;
+		// Matches that end left of the window are skipped, one that
+		// starts left of it is lit from the window on.
+		while (s >= hl_end) {
+			size_t span = MIN((size_t)(end - from),
+			                  (size_t)(s - from) + E.cols - w + q);
+			hl = q ? find_highlight(line, from, span, &hl_end) : NULL;
+			if (!hl) hl = hl_end = end;
+			from = hl_end;
+		}
+		if (!lit && hl <= s) {
+			screen_append(screen, "\x1b[7m", 4);
+			lit = true;
+		}
 
-	if (E.message.len > 0) {
-		size_t len = (size_t)(E.message.len > (size_t)remaining
-		                              ? (size_t)remaining
-		                              : E.message.len);
-		screen_append(screen, E.message.data, len);
-		remaining -= len;
+		n = MIN((uint)(end - s), E.cols - w);
+		n = MIN(n, (uint)((s < hl ? hl : hl_end) - s));
+		if ((tab = memchr(s, '\t', n))) n = (uint)(tab - s);
+		screen_append(screen, s, n);
+		s += n, w += n;
+		if (!tab) continue;
+
+		n = MIN(TABSTOP - 1 - (E.coloff + w) % TABSTOP, E.cols - w - 1);
+		screen_append(screen, &E.render_tab_characters[0], 1);
+		screen_fill(screen, E.render_tab_characters[1], n);
+		s++, w += n + 1;
 	}
-	while (remaining--) screen_append(screen, " ", 1);
-	screen_append(screen, duration_msg, (size_t)duration_len);
+	if (lit) screen_append(screen, "\x1b[27m", 5);
+}
+
+static int place_cursor(ScreenBuffer *screen, uint x, uint y) {
+	char s[32];
+	int len = snprintf(s, sizeof s, "\x1b[%d;%dH", y + 1, x + 1);
+	if (len == -1 || len >= (int)sizeof s) DIE("place_cursor");
+	screen_append(screen, s, (uint)len);
 
 	return 0;
 }
 
-static uint render(const Line *line, char *dst, const size_t size) {
-	uint length = 0;
-	for (uint i = 0; i < line->len && i < size - 1; i++)
-		if (line->chars[i] == '\t') {
-			dst[length++] = E.render_tab_characters[0];
-			while (length % TABSTOP)
-				dst[length++] = E.render_tab_characters[1];
-		} else dst[length++] = line->chars[i];
-
-	return length;
+// FNV-1a
+static unsigned long hash(const char *s, size_t len) {
+	unsigned long h = 14695981039346656037ul;
+	while (len--) h = (h ^ (unsigned char)*s++) * 1099511628211ul;
+	return h;
 }
 
-static void draw_line(ScreenBuffer *screen, Line *line) {
-	if (E.coloff >= line->len) return;
-	uint rendered_len =
-		render(line, E.render_buffer, sizeof(E.render_buffer));
-	uint visible_len = MIN(rendered_len - E.coloff, E.cols);
-	screen_append(screen, E.render_buffer + E.coloff, visible_len);
+// Shifts the text rows up (d > 0) or down by |d| with a scroll region, so
+// only the rows scrolled into view have to be drawn. The row hashes move
+// along and are cleared for the new rows.
+static bool scroll_rows(ScreenBuffer *screen, int d) {
+	uint text = E.rows - NUM_UTIL_LINES, n = (uint)abs(d);
+	if (n >= text || E.rows > MAX_ROWS) return false;
+
+	char s[48];
+	int len = snprintf(s, sizeof s, "\x1b[1;%ur\x1b[%u%c\x1b[r", text, n,
+	                   d > 0 ? 'S' : 'T');
+	screen_append(screen, s, (size_t)len);
+
+	unsigned long *h = E.rowhash;
+	if (d > 0) {
+		memmove(h, h + n, (text - n) * sizeof *h);
+		memset(h + text - n, 0, n * sizeof *h);
+	} else {
+		memmove(h + n, h, (text - n) * sizeof *h);
+		memset(h, 0, n * sizeof *h);
+	}
+	return true;
 }
 
-static void draw_lines(ScreenBuffer *screen, const struct timespec *duration) {
+static void draw_lines(ScreenBuffer *screen) {
+	int d = (int)E.rowoff - (int)E.drawn_rowoff;
+	bool moved = E.coloff != E.drawn_coloff || (d && !scroll_rows(screen, d));
+
 	for (uint y = 0; y < E.rows; y++) {
 		uint line_index = y + E.rowoff;
+		if (!moved && line_index < E.damage && E.rows - y > 2 &&
+		    (y >= MAX_ROWS || E.rowhash[y]))
+			continue;
+
+		size_t start = screen->len;
+		place_cursor(screen, 0, y);
 
 		if (E.rows - y == 2) draw_status(screen);
-		else if (E.rows - y == 1) draw_message(screen, duration);
+		else if (E.rows - y == 1) draw_message(screen);
 		else if (line_index < E.numlines)
-			draw_line(screen, E.lines + line_index);
+			draw_line(screen, line_index);
 		else screen_append(screen, "~", 1);
 
-		// TODO: Welcome screen
 		if (NOLINES && y == E.rows / 3) draw_welcome_message(screen);
 
 		// Close of the line
 		screen_append(screen, "\x1b[K", 3);
-		if (E.rows - y > 1) screen_append(screen, "\r\n", 2);
-	}
-}
 
-static int place_cursor(ScreenBuffer *screen, uint x, uint y) {
-	char s[32];
-	int len = snprintf(s, sizeof s, "\x1b[%d;%dH", y + 1, x + 1);
-	if (len == -1 || len >= (int)sizeof s) DIE("place_cursor");
-	screen_append(screen, s, (uint)len);
+		// Drop the row again if the terminal already shows it
+		unsigned long h = hash(screen->data + start, screen->len - start);
+		if (y >= MAX_ROWS) continue;
+		if (E.rowhash[y] == h) screen->len = start;
+		else E.rowhash[y] = h;
+	}
 
-	return 0;
+	E.damage = E.numlines;
+	E.drawn_rowoff = E.rowoff;
+	E.drawn_coloff = E.coloff;
 }
 
-static struct timespec refresh_screen(const struct timespec *duration) {
+static void refresh_screen(void) {
 	E.screen.len = 0;
-	editor_scroll();
+	PROFILE("stitch_chunks", stitch_chunks(E.rowoff + E.rows));
+	PROFILE("editor_scroll", editor_scroll());
 	screen_append(&E.screen, "\x1b[?25l", 6); // hide cursor
 
-	place_cursor(&E.screen, 0, 0);
-	draw_lines(&E.screen, duration);
+	PROFILE("draw_lines", draw_lines(&E.screen));
 	place_cursor(&E.screen, E.rx - E.coloff, E.cy - E.rowoff);
 
 	screen_append(&E.screen, "\x1b[?25h", 6); // show cursor
-	write(STDOUT_FILENO, E.screen.data, E.screen.len);
-
-	return get_current_time();
+	PROFILE("write", screen_flush(&E.screen));
+	E.written = E.screen.len;
+	E.frame_writes = E.screen.writes;
+	E.frame_copies = E.screen.copies;
+	E.screen.writes = 0;
+	E.screen.copies = 0;
+	E.frames++;
+	E.total_bytes += E.written;
+
+	if (E.keys == 0) return;
+	E.latency = get_current_time() - E.received;
+	E.histogram[bucket_of(E.latency)]++;
+	E.latency_max = MAX(E.latency_max, E.latency);
+	E.batch = E.keys;
+	E.total_keys += E.keys;
+	E.keys = 0;
 }
 
 // -------------------------------- File I/O ----------------------------------
@@ -1031,106 +2835,404 @@ static uint line_length(const char *chars, uint len) {
 	return len;
 }
 
-static void editor_append_line(const char *chars, uint len) {
-	uint i = E.numlines;
-	E.numlines++;
-	E.lines = realloc(E.lines, (sizeof *E.lines) * E.numlines);
-	len = line_length(chars, len);
-	E.lines[i].chars = strndup(chars, len);
-	E.lines[i].len = len;
+static void chunk_append(Chunk *c, char *chars, uint len) {
+	if (c->numlines == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 1024;
+		c->lines = realloc(c->lines, (sizeof *c->lines) * c->cap);
+		if (!c->lines) DIE("realloc");
+	}
+	c->lines[c->numlines++] = (Line){line_length(chars, len), 0, chars};
+}
+
+// Appends the lines ending in the block at `p`, whose newlines are the set
+// bits of `mask`. They are read off the mask bit by bit, which saves a memchr
+// call per line. Returns the start of the line that is still open.
+static inline char *index_block(Chunk *c, char *line, char *p, uint mask) {
+	for (; mask; mask &= mask - 1) {
+		char *next = p + __builtin_ctz(mask) + 1;
+		chunk_append(c, line, (uint)(next - line));
+		line = next;
+	}
+	return line;
+}
+
+typedef char *Indexer(Chunk *c, char *line, char *p, char *end);
+
+#ifdef __x86_64__
+static char *index_sse2(Chunk *c, char *line, char *p, char *end) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	for (; p + 16 <= end; p += 16) {
+		__m128i block = _mm_loadu_si128((const void *)p);
+		uint mask = (uint)_mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+		line = index_block(c, line, p, mask);
+	}
+	return line;
+}
+
+__attribute__((target("avx2")))
+static char *index_avx2(Chunk *c, char *line, char *p, char *end) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	for (; p + 32 <= end; p += 32) {
+		__m256i block = _mm256_loadu_si256((const void *)p);
+		uint mask = (uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+		line = index_block(c, line, p, mask);
+	}
+	return line;
+}
+#endif
+
+// The widest scanner the CPU supports. NI_SCAN=memchr forces the plain
+// memchr loop, for comparing the two in `make bench`.
+static Indexer *pick_indexer(void) {
+	const char *scan = getenv("NI_SCAN");
+	if (scan && strcmp(scan, "memchr") == 0) return NULL;
+#ifdef __x86_64__
+	return __builtin_cpu_supports("avx2") ? index_avx2 : index_sse2;
+#else
+	return NULL;
+#endif
+}
+
+// Indexes the lines that start in the chunk. The last of them may end
+// further on in the file. The tail that doesn't fill a block is left to
+// memchr.
+static void index_chunk(Chunk *c) {
+	char *p = c->start, *end = c->end, *eof = E.map + E.maplen;
+	if (p > E.map && p[-1] != '\n') {
+		char *nl = memchr(p, '\n', (size_t)(end - p));
+		p = nl ? nl + 1 : end;
+	}
+
+	Indexer *index = pick_indexer();
+	char *line = index ? index(c, p, p, end) : p;
+
+	while (line < end) {
+		char *nl = memchr(line, '\n', (size_t)(eof - line));
+		char *next = nl ? nl + 1 : eof;
+		chunk_append(c, line, (uint)(next - line));
+		line = next;
+	}
+}
+
+static void *index_worker(void *arg) {
+	(void)arg;
+	while (true) {
+		pthread_mutex_lock(&E.index_lock);
+		uint i = E.next_chunk++;
+		pthread_mutex_unlock(&E.index_lock);
+		if (i >= E.numchunks) return NULL;
+
+		index_chunk(&E.chunks[i]);
+
+		pthread_mutex_lock(&E.index_lock);
+		E.chunks[i].done = true;
+		pthread_cond_signal(&E.index_cond);
+		pthread_mutex_unlock(&E.index_lock);
+		ssize_t n = write(E.wake_pipe[1], "i", 1);
+		(void)n;
+	}
+}
+
+static void report_loaded(void) {
+	unsigned long us = MAX(get_current_time() - E.index_started, 1);
+	format_message("Loaded: \"%s\" %u lines (%.2f GB/s)", E.filename,
+	               E.numlines, (double)E.maplen / (double)us / 1000);
+}
+
+// Appends the indexed chunks to the line table, in file order. Waits for the
+// workers only while there are fewer than `need` lines.
+static void stitch_chunks(uint need) {
+	pthread_mutex_lock(&E.index_lock);
+	while (E.stitched < E.numchunks) {
+		Chunk *c = &E.chunks[E.stitched];
+		if (!c->done && E.numlines >= need) break;
+		if (!c->done) {
+			pthread_cond_wait(&E.index_cond, &E.index_lock);
+			continue;
+		}
+
+		E.damage = MIN(E.damage, E.numlines);
+		append_lines(c->lines, c->numlines);
+		free(c->lines);
+		if (++E.stitched == E.numchunks) report_loaded();
+	}
+	pthread_mutex_unlock(&E.index_lock);
 }
 
 static void editor_open(const char *restrict fname) {
-	FILE *f = fopen(fname, "r");
-	if (!f) DIE("fopen");
+	E.index_started = get_current_time();
+	int fd = open(fname, O_RDONLY);
+	if (fd == -1) DIE("open");
 
-	E.numlines = 0;
-	if (E.lines) free(E.lines);
-	E.lines = NULL;
+	struct stat st;
+	if (fstat(fd, &st) == -1) DIE("fstat");
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t bytes_read;
+	E.numlines = E.linecap = E.gap = 0;
+	free(E.lines);
+	E.lines = NULL;
 
-	while ((bytes_read = getline(&line, &linecap, f)) != -1)
-		editor_append_line(line, (uint)bytes_read);
+	// Map the file instead of reading it. Lines borrow their characters
+	// from the mapping, so loading only has to find the line breaks.
+	if (E.map) munmap(E.map, E.maplen);
+	E.map = NULL;
+	E.maplen = (size_t)st.st_size;
+	if (E.maplen > 0) {
+		E.map = mmap(NULL, E.maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (E.map == MAP_FAILED) DIE("mmap");
+	}
+	close(fd);
 
-	if (line) free(line);
-	fclose(f);
 	if (E.filename) free(E.filename);
 	E.filename = strdup(fname);
 
-	format_message("Loaded: \"%s\"", fname);
+	E.numchunks = (uint)(E.maplen / CHUNK_SIZE) + 1;
+	E.chunks = calloc(E.numchunks, sizeof *E.chunks);
+	if (!E.chunks) DIE("calloc");
+	for (uint i = 0; i < E.numchunks; i++) {
+		size_t end = MIN((size_t)(i + 1) * CHUNK_SIZE, E.maplen);
+		E.chunks[i].start = E.map + (size_t)i * CHUNK_SIZE;
+		E.chunks[i].end = E.map + end;
+	}
+
+	// The first chunk is indexed right away so that the first screen can be
+	// drawn. The workers pick up the rest.
+	index_chunk(&E.chunks[0]);
+	E.chunks[0].done = true;
+	E.next_chunk = 1;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < MIN(cpus, (long)E.numchunks - 1); i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, index_worker, NULL)) DIE("pthread");
+		pthread_detach(thread);
+	}
+
+	stitch_chunks(0);
 }
 
-static void editor_save(void) {
-	if (!E.filename) return;
+// Writes all of `iov`, picking up after partial writes.
+static bool write_all(int fd, struct iovec *iov, int n) {
+	while (n > 0) {
+		ssize_t w = writev(fd, iov, n);
+		if (w < 0 && errno == EINTR) continue;
+		if (w < 0) return false;
+
+		for (; n > 0 && (size_t)w >= iov->iov_len; n--) w -= iov++->iov_len;
+		if (n == 0) break;
+		iov->iov_base = (char *)iov->iov_base + w;
+		iov->iov_len -= (size_t)w;
+	}
+	return true;
+}
 
-	FILE *f = fopen(E.filename, "w");
-	if (!f) DIE("fopen");
+// Moves the mapping of the open file onto an unlinked copy of it, so that
+// the lines that point into it survive the file being overwritten.
+static bool copy_mapping(Save *s) {
+	if (!E.map || s->copied) return true;
+	char tmp[PATH_MAX + 8]; // room for ".XXXXXX"
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", s->path);
+	int fd = mkstemp(tmp);
+	if (fd == -1) return false;
+	unlink(tmp);
+
+	struct iovec iov = {E.map, E.maplen};
+	s->copied = write_all(fd, &iov, 1) &&
+	            mmap(E.map, E.maplen, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
+	                 0) != MAP_FAILED;
+	close(fd);
+	return s->copied;
+}
+
+// Streams the snapshot into a temporary file next to the original, a batch
+// of lines per writev, and renames it over the original once it is synced.
+// A failed save leaves the file as it was. The old file stays alive for the
+// lines that still point into its mapping. A file with more than one name
+// is overwritten in place instead, so that all of them see the new text;
+// a failed save can leave that one cut short. Runs on the save thread.
+static void *write_snapshot(void *arg) {
+	Save *s = arg;
+	struct stat st;
+	bool exists = stat(s->path, &st) == 0;
+	bool in_place = exists && st.st_nlink > 1;
+	char tmp[PATH_MAX + 8];
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", s->path);
+	int fd = -1;
+	if (!in_place) fd = mkstemp(tmp);
+	else if (copy_mapping(s)) fd = open(s->path, O_WRONLY | O_TRUNC);
+	bool ok = fd != -1;
+
+	// Keep the mode of the original, or give a new file the default one
+	if (!in_place)
+		ok = ok && fchmod(fd, exists ? st.st_mode & 07777
+		                             : 0666 & ~s->umask) == 0;
+
+	struct iovec iov[2 * SAVE_BATCH];
+	size_t bytes = 0, reported = 0;
+	for (uint i = 0; ok && i < s->numlines;) {
+		int n = 0;
+		for (; i < s->numlines && n < 2 * SAVE_BATCH; i++) {
+			const Line *line = &s->lines[i];
+			iov[n++] = (struct iovec){line->chars, line->len};
+			iov[n++] = (struct iovec){"\n", 1};
+			bytes += line->len + 1;
+		}
+		ok = write_all(fd, iov, n);
 
-	for (uint i = 0; i < E.numlines; i++) {
-		fputs(E.lines[i].chars, f);
-		fputs("\n", f);
+		atomic_store(&s->written, bytes);
+		if (bytes - reported < SAVE_PROGRESS) continue;
+		reported = bytes;
+		ssize_t w = write(E.wake_pipe[1], "s", 1);
+		(void)w;
 	}
 
-	fclose(f);
+	ok = ok && fsync(fd) == 0;
+	ok = (fd == -1 || close(fd) == 0) && ok;
+	ok = ok && (in_place || rename(tmp, s->path) == 0);
+	s->error = ok ? 0 : errno;
+	if (!ok && fd != -1 && !in_place) unlink(tmp);
+
+	atomic_store(&s->done, true);
+	ssize_t w = write(E.wake_pipe[1], "s", 1);
+	(void)w;
+	return NULL;
+}
+
+// Starts writing a snapshot of the buffer in the background.
+static bool editor_save(void) {
+	Save *s = &E.save;
+	if (!E.filename) return false;
+	if (s->running) {
+		format_message("Saving: \"%s\" (queued)", E.filename);
+		return s->again = true;
+	}
+	stitch_chunks(UINT_MAX);
+
+	// Write through symlinks; a new file has nothing to resolve yet
+	if (!realpath(E.filename, s->path))
+		snprintf(s->path, sizeof s->path, "%s", E.filename);
+	s->lines = take_snapshot(0, E.numlines);
+	s->numlines = E.numlines;
+	s->generation = E.generation;
+	s->started = get_current_time();
+	atomic_store(&s->written, 0);
+	s->shown = 0;
+	atomic_store(&s->done, false);
+
+	if (pthread_create(&s->thread, NULL, write_snapshot, s)) DIE("pthread");
+	s->running = true;
+	format_message("Saving: \"%s\"", E.filename);
+	return true;
+}
+
+// Reports the progress of a running save, or wraps it up once the save
+// thread is done (or right away with `wait`).
+static void poll_save(bool wait) {
+	Save *s = &E.save;
+	if (!s->running) return;
+	if (!wait && !atomic_load(&s->done)) {
+		size_t mb = atomic_load(&s->written) >> 20;
+		if (mb != s->shown)
+			format_message("Saving: \"%s\" %zu MB", E.filename, mb);
+		s->shown = mb;
+		return;
+	}
+
+	pthread_join(s->thread, NULL);
+	s->running = false;
+	drop_snapshot(s->lines);
+
+	size_t bytes = atomic_load(&s->written);
+	unsigned long us = MAX(get_current_time() - s->started, 1);
+	if (s->error)
+		format_message("Can't save \"%s\": %s", E.filename,
+		               strerror(s->error));
+	else format_message("Saved: \"%s\" %zu bytes (%.2f GB/s)", E.filename,
+	                    bytes, (double)bytes / (double)us / 1000);
+	if (!s->error && s->generation == E.generation) E.dirty = false;
+
+	if (s->again) {
+		s->again = false;
+		editor_save();
+	}
+}
 
-	format_message("Saved: \"%s\"", E.filename);
-	E.dirty = false;
+// Blocks until the running save and a queued one, if any, are done.
+static void wait_save(void) {
+	while (E.save.running) poll_save(true);
 }
 
 // ---------------------------------- Main ------------------------------------
-static void handle_resize(int sig) {
+// Only wakes up the main loop; everything else happens in handle_resize.
+static void on_sigwinch(int sig) {
 	(void)sig;
+	int saved_errno = errno;
+	ssize_t n = write(E.wake_pipe[1], "w", 1);
+	(void)n;
+	errno = saved_errno;
+}
+
+static void handle_resize(void) {
+	E.resized = false;
 	if (get_window_size(&E.rows, &E.cols) == -1) DIE("get_window_size");
-	refresh_screen(NULL);
+	memset(E.rowhash, 0, sizeof E.rowhash);
+	E.damage = 0;
 }
 
+// Everything else in E starts out zeroed.
 static void editor_init(void) {
-	E.mode = MODE_NORMAL;
-	E.lines = NULL;
-	E.filename = NULL;
-	E.numlines = 0;
-	E.rowoff = E.coloff = 0;
-	E.cx = E.cy = E.rx = 0;
 	E.render_tab_characters[0] = '>';
 	E.render_tab_characters[1] = '-';
-	E.message.len = 0;
-	E.dirty = false;
-	E.chord.len = 0;
-	E.find.c = 0;
 
+	if (pipe(E.wake_pipe) == -1) DIE("pipe");
+	fcntl(E.wake_pipe[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&E.index_lock, NULL);
+	pthread_cond_init(&E.index_cond, NULL);
+	pthread_mutex_init(&E.matches.lock, NULL);
+	pthread_cond_init(&E.matches.cond, NULL);
+	E.save.umask = umask(0);
+	umask(E.save.umask);
+	if (E.replay) return;
+
+	enable_raw_mode();
+	signal(SIGWINCH, on_sigwinch);
 	if (get_window_size(&E.rows, &E.cols) == -1) DIE("get_window_size");
 }
 
-static struct timespec
-elapsed_time(const struct timespec *start, const struct timespec *end) {
-	struct timespec elapsed;
-
-	elapsed.tv_sec = end->tv_sec - start->tv_sec;
-	elapsed.tv_nsec = end->tv_nsec - start->tv_nsec;
-
-	if (elapsed.tv_nsec < 0) {
-		elapsed.tv_nsec += 1000000000;
-		elapsed.tv_sec--;
-	}
-
-	return elapsed;
+static void report_replay(void) {
+	double s = (double)(get_current_time() - E.started) / 1e6;
+	fprintf(stderr, "%lu keys %lu frames %lu bytes %.3f s: %.0f keys/s "
+	        "%.0f frames/s\n", E.total_keys, E.frames, E.total_bytes, s,
+	        (double)E.total_keys / s, (double)E.frames / s);
 }
 
+// Usage: ni [FILE]
+//        ni -r ROWSxCOLS [FILE] < KEYS > OUTPUT
 int main(int argc, char *argv[]) {
-	signal(SIGWINCH, handle_resize);
-	enable_raw_mode();
+	if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+		if (sscanf(argv[2], "%ux%u", &E.rows, &E.cols) != 2) return 2;
+		E.replay = true;
+		E.started = get_current_time();
+		atexit(report_replay);
+		argc -= 2, argv += 2;
+	}
 	editor_init();
+	atexit(dump_histogram);
+	atexit(wait_save);
+	if (getenv("NI_TRACE")) E.trace = fopen(getenv("NI_TRACE"), "w");
 	if (argc >= 2) editor_open(argv[1]);
 
-	struct timespec render_done, input_received = get_current_time();
-	struct timespec duration = {0};
-
 	while (true) {
-		render_done = refresh_screen(&duration);
-		duration = elapsed_time(&input_received, &render_done);
-		input_received = process_key();
+		if (E.resized) handle_resize();
+		poll_save(false);
+		poll_matches();
+		refresh_screen();
+		// The keys are only read once they are there, so that the
+		// profiler times decoding them, not waiting for them.
+		if (E.input.pos == E.input.len) input_wait(-1);
+		while (E.input.pos < E.input.len) {
+			process_key();
+			if (E.replay) break;
+		}
+		if (E.replay && E.input.eof) exit(EXIT_SUCCESS);
 	}
 }